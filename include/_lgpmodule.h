@@ -6,29 +6,92 @@ extern "C" {
 #endif
 
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <string.h>
 #include <malloc.h>
 #include <sys/stat.h>
 
 #define LOOKUP_VALUE_MAX 30
-#define LOOKUP_TABLE_ENTRIES LOOKUP_VALUE_MAX * LOOKUP_VALUE_MAX
+#define LOOKUP_TABLE_ENTRIES (LOOKUP_VALUE_MAX * LOOKUP_VALUE_MAX)
 
 #define MAX_CONFLICTS 4096
+#define MAX_CONFLICT_ENTRIES 255
+
+/* ToC indices are stored (plus one) in the 2 bytes of the lookup table */
+#define MAX_FILES 65535
+/* and offsets in the 4 bytes of the ToC entries */
+#define MAX_ARCHIVE_SIZE 0xFFFFFFFFULL
+/* a split pack spills its file list to a temporary file every MAX_FILES
+ * files, and merges the runs back, each one keeping a file open */
+#define MAX_SPILL_RUNS 256
+#define MAX_SPLIT_FILES (MAX_SPILL_RUNS * MAX_FILES)
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+/* size of the chunks used to copy the input files into the archive */
+#define COPY_BUFFER_SIZE (1 << 20)
+
+/* sizes of the records as stored in the archive, without any padding */
+#define TOC_ENTRY_SIZE 27
+#define FILE_HEADER_SIZE 24
+#define LOOKUP_TABLE_SIZE (LOOKUP_TABLE_ENTRIES * 4)
+#define CONFLICT_ENTRY_SIZE 130
+
+/* upper bound of the header size, if every file was part of a conflict */
+#define HEADER_SIZE_MAX(files) (16 + (files) * (TOC_ENTRY_SIZE + 2ULL + CONFLICT_ENTRY_SIZE) + LOOKUP_TABLE_SIZE + 2)
 
 #ifdef _WIN32
 #include "_dirent.h"
 #include <direct.h>
+#include <io.h>
 #define mkdir(path, mode) _mkdir(path)
+#define strcasecmp _stricmp
+
+static inline Py_ssize_t pread(int fd, void *buf, size_t size, long long offset)
+{
+    if (_lseeki64(fd, offset, SEEK_SET) < 0) return -1;
+    return _read(fd, buf, (unsigned int)size);
+}
+
+static inline void *memmem(const void *haystack, size_t size, const void *needle, size_t length)
+{
+    const char *p = haystack;
+    const char *end = p + size;
+
+    if (!length) return (void *)p;
+
+    while ((size_t)(end - p) >= length && (p = memchr(p, *(const char *)needle, end - p - length + 1)))
+    {
+        if (!memcmp(p, needle, length)) return (void *)p;
+        p++;
+    }
+
+    return NULL;
+}
 #else
 #include <dirent.h>
+#include <pthread.h>
+#include <strings.h>
+#include <unistd.h>
+/* packing can copy the input files from several threads */
+#define LGP_THREADS
 #endif
 
 typedef struct _lgp {
     PyObject_HEAD
-    const char *file;
+    /* only one of those is set, depending on what the archive was opened from */
+    PyObject *path;     /* file name, as bytes */
+    int fd;             /* file descriptor, -1 if unused */
+    Py_buffer view;     /* buffer, view.obj is NULL if unused */
 } _LGPObject;
 
+/* The structures below are only used in memory; in the archive, every
+ * integer is little-endian and nothing is padded, see the lgp_get_* and
+ * lgp_put_* functions */
 struct toc_entry
 {
     char name[20];
@@ -55,20 +118,86 @@ struct conflict_entry
     unsigned short toc_index;
 };
 
-inline int lgp_lookup_value(unsigned char c)
+static inline unsigned short lgp_get_u16(const unsigned char *p)
+{
+    return p[0] | p[1] << 8;
+}
+
+static inline unsigned int lgp_get_u32(const unsigned char *p)
 {
-    c = tolower(c);
+    return p[0] | p[1] << 8 | p[2] << 16 | (unsigned int)p[3] << 24;
+}
 
-    if(c == '.') return -1;
+static inline void lgp_put_u16(unsigned char *p, unsigned short value)
+{
+    p[0] = value & 0xFF;
+    p[1] = value >> 8;
+}
 
-    if(c < 'a' && c >= '0' && c <= '9') c += 'a' - '0';
+static inline void lgp_put_u32(unsigned char *p, unsigned int value)
+{
+    p[0] = value & 0xFF;
+    p[1] = (value >> 8) & 0xFF;
+    p[2] = (value >> 16) & 0xFF;
+    p[3] = value >> 24;
+}
 
-    if(c == '_') c = 'k';
-    if(c == '-') c = 'l';
+/* The lookup value of a character, without depending on the locale:
+ * letters (either case) and digits both count from 0, and '_' and '-' are
+ * treated as 'k' and 'l'. A dot, which ends the name, is -1. Anything else
+ * ends up outside of 0..LOOKUP_VALUE_MAX - 1 and can't be used in a name. */
+#define LOOKUP_VALUE(c) \
+    ((c) >= 'A' && (c) <= 'Z' ? (c) - 'A' : \
+     (c) >= '0' && (c) <= '9' ? (c) - '0' : \
+     (c) == '.' ? -1 : \
+     (c) == '_' ? 'k' - 'a' : \
+     (c) == '-' ? 'l' - 'a' : \
+     (c) - 'a')
+
+#define LOOKUP_VALUES_4(c) LOOKUP_VALUE(c), LOOKUP_VALUE(c + 1), LOOKUP_VALUE(c + 2), LOOKUP_VALUE(c + 3)
+#define LOOKUP_VALUES_16(c) LOOKUP_VALUES_4(c), LOOKUP_VALUES_4(c + 4), LOOKUP_VALUES_4(c + 8), LOOKUP_VALUES_4(c + 12)
+#define LOOKUP_VALUES_64(c) LOOKUP_VALUES_16(c), LOOKUP_VALUES_16(c + 16), LOOKUP_VALUES_16(c + 32), LOOKUP_VALUES_16(c + 48)
+
+static const short lgp_lookup_values[256] = {
+    LOOKUP_VALUES_64(0), LOOKUP_VALUES_64(64), LOOKUP_VALUES_64(128), LOOKUP_VALUES_64(192)
+};
 
-    return c - 'a';
+static inline int lgp_lookup_value(unsigned char c)
+{
+    return lgp_lookup_values[c];
 }
 
+/* Index into the lookup table for a name, or -1 if the name can't have one */
+static inline int lgp_lookup_index(const char *name)
+{
+    int lookup_value1 = lgp_lookup_values[(unsigned char)name[0]];
+    int lookup_value2 = lgp_lookup_values[(unsigned char)name[1]];
+    int lookup_index = lookup_value1 * LOOKUP_VALUE_MAX + lookup_value2 + 1;
+
+    if(lookup_value1 >= LOOKUP_VALUE_MAX || lookup_value1 < 0 || lookup_value2 >= LOOKUP_VALUE_MAX || lookup_value2 < -1 || lookup_index >= LOOKUP_TABLE_ENTRIES)
+        return -1;
+
+    return lookup_index;
+}
+
+/* Compute the lookup indices of 'count' names laid out 'stride' bytes apart,
+ * such as the names of an array of ToC entries. The loop has no branches,
+ * leaving the compiler free to unroll and vectorize it. */
+static inline void lgp_lookup_indices(const char *names, size_t stride, int count, int *indices)
+{
+    int i;
+
+    for(i = 0; i < count; i++)
+    {
+        const unsigned char *name = (const unsigned char *)names + i * stride;
+        int lookup_value1 = lgp_lookup_values[name[0]];
+        int lookup_value2 = lgp_lookup_values[name[1]];
+        int lookup_index = lookup_value1 * LOOKUP_VALUE_MAX + lookup_value2 + 1;
+        int valid = (unsigned)lookup_value1 < LOOKUP_VALUE_MAX && (unsigned)(lookup_value2 + 1) <= LOOKUP_VALUE_MAX && lookup_index < LOOKUP_TABLE_ENTRIES;
+
+        indices[i] = valid ? lookup_index : -1;
+    }
+}
 
 #ifdef __cplusplus
 }
@@ -26,9 +26,31 @@ __author__ = "Vgr"
 
 _libname_ = __file__[-list(reversed(__file__.replace("\\", "/"))).index("/"):]
 
+import asyncio
+import collections
+import concurrent.futures
+import contextlib
+import errno
+import fnmatch
 import hashlib
+import itertools
+import json
+import mmap
 import sys
+import urllib.parse
 import os
+import re
+import stat
+import struct
+import tarfile
+import time
+import zipfile
+
+try:
+    import _lgp
+except ImportError:
+    # the C extension is optional, what uses it has a slower fallback
+    _lgp = None
 
 # this stores the parsed files' hashes, to avoid parsing multiple times
 # parsing a single LGP file is a very time-confusing task
@@ -139,7 +161,75 @@ def read(file):
 
         return _files_contents[file]
 
-def extract(file, folder=None):
+def _matches(path, patterns):
+    # glob patterns ignore case like the game does, regexes are used as given
+    for pattern in patterns:
+        if isinstance(pattern, str):
+            if fnmatch.fnmatchcase(path.lower(), pattern.replace("\\", "/").lower()):
+                return True
+        elif pattern.search(path):
+            return True
+    return False
+
+def _select(members, include=None, exclude=None, min_size=None, max_size=None):
+    # a single pattern can be given instead of a list
+    if isinstance(include, str) or hasattr(include, "search"):
+        include = [include]
+    if isinstance(exclude, str) or hasattr(exclude, "search"):
+        exclude = [exclude]
+    selected = []
+    for member in members:
+        if include is not None and not _matches(member.path, include):
+            continue
+        if exclude is not None and _matches(member.path, exclude):
+            continue
+        if min_size is not None and member.size < min_size:
+            continue
+        if max_size is not None and member.size > max_size:
+            continue
+        selected.append(member)
+    return selected
+
+def _up_to_date(target, data, checksum):
+    # whether the file at 'target' already holds 'data'
+    try:
+        with open(target, "rb") as f:
+            if os.fstat(f.fileno()).st_size != len(data):
+                return False
+            if not checksum:
+                return True
+            # comparing as we read is cheaper than hashing both sides
+            for start in range(0, len(data), 1 << 20):
+                if f.read(1 << 20) != data[start:start+(1 << 20)]:
+                    return False
+            return True
+    except OSError:
+        return False
+
+def _prune(folder, keep):
+    # remove the files of 'folder' that aren't in 'keep', then empty folders
+    for root, dirs, files in os.walk(folder, topdown=False):
+        for name in files:
+            path = os.path.join(root, name)
+            if os.path.normcase(path) not in keep:
+                os.remove(path)
+        if root != folder and not os.listdir(root):
+            os.rmdir(root)
+
+def extract(file, folder=None, include=None, exclude=None, min_size=None, max_size=None,
+            incremental=False, checksum=False, prune=False):
+    """Extract the members of an archive into a folder.
+
+    'include' and 'exclude' are glob patterns (matched against the
+    resolved path, ignoring case) or compiled regexes, or lists of them;
+    'min_size' and 'max_size' filter on the data size. Members are
+    selected from the header alone, then only those are read, in the
+    order their data appears in the archive.
+    With 'incremental', files already in the folder with the same size
+    are left alone, so their modification time doesn't change; with
+    'checksum' as well, their contents are compared too. 'prune' removes
+    the files of the folder which aren't members of the archive.
+    Returns the paths of the files written."""
     if folder is None:
         indx = None
         if "." in file:
@@ -149,89 +239,1762 @@ def extract(file, folder=None):
         os.mkdir(folder)
     folder = folder.replace("\\", "/")
 
-    files, all_conflicts, total = read(file)
-
-    for filename, cursor, offset, conflicts in files:
-        # this will dynamically check for any conflict
-        directory = all_conflicts.get(cursor, "")
-        directory = directory.replace("\\", "/").replace("\x00", "")
-        if directory and not os.path.isdir(os.path.join(folder, directory)):
-            new = folder
-            for fold in directory.split("/"):
-                new = os.path.join(new, fold)
-                if not os.path.isdir(new):
-                    os.mkdir(new)
-        new = total[int(offset, 16):]
-        fname, new = (new[:20], new[20:])
-        flen, new = (new[:4], new[4:])
-        flen = int.from_bytes(flen, "little")
-        data = new[:flen]
-        with open(os.path.join(folder, directory, filename), "wb") as w:
-            w.write(data)
+    written = []
+    with _map(file) as data:
+        every = _members(data, _parse_header(data))
+        members = _select(every, include, exclude, min_size, max_size)
+        view = memoryview(data)
+        try:
+            for member in sorted(members, key=lambda m: m.offset):
+                target = os.path.join(folder, *member.path.split("/"))
+                start = member.offset + 24
+                with view[start:start+member.size] as chunk:
+                    if incremental and _up_to_date(target, chunk, checksum):
+                        continue
+                    os.makedirs(os.path.dirname(target), exist_ok=True)
+                    with open(target, "wb") as w:
+                        w.write(chunk)
+                written.append(target)
+        finally:
+            view.release()
+    if prune:
+        _prune(folder, {os.path.normcase(os.path.join(folder, *m.path.split("/"))) for m in every})
+    return written
+
+# the following helpers work on the raw archive bytes (or an mmap of them)
+# unlike read(), they parse every region of the header, lookup table included
+# they are used by everything that needs to check or rewrite an archive
+
+# a single entry of the Table of Contents, as it is stored on disk
+_TocEntry = collections.namedtuple("_TocEntry", "name offset unknown conflict")
+
+# everything before the first data block: ToC, lookup table and conflicts
+# 'size' is the offset right past the end of the conflicts table
+_Header = collections.namedtuple("_Header", "creator toc lookup conflicts size")
+
+# a member of the archive, with its subdirectory resolved from the conflicts
+# 'offset' points to the 24-bytes file header, the data follows right after
+_Member = collections.namedtuple("_Member", "index name path offset size")
+
+# number of values a single character can take in the lookup table
+_LOOKUP_VALUE_MAX = 30
+_LOOKUP_TABLE_ENTRIES = _LOOKUP_VALUE_MAX * _LOOKUP_VALUE_MAX
+
+# hash used for the integrity manifests; blake2b is in the standard library
+# and hashlib releases the GIL while hashing, so threads can hash in parallel
+_MANIFEST_HASH = "blake2b"
+
+def _lookup_value(c):
+    # this mirrors the LOOKUP_VALUE() macro from the C header
+    # it's locale-independent, unlike str.lower()
+    if ord("A") <= c <= ord("Z"):
+        return c - ord("A")
+    if ord("0") <= c <= ord("9"):
+        return c - ord("0")
+    if c == ord("."):
+        return -1
+    if c == ord("_"):
+        c = ord("k")
+    if c == ord("-"):
+        c = ord("l")
+    return c - ord("a")
+
+# computed once for every byte, so lookups are a simple indexing
+_LOOKUP_VALUES = tuple(_lookup_value(c) for c in range(256))
+
+def _lookup_index(name):
+    # the index into the lookup table is computed from the first two characters
+    # the second one may be a dot, hence the "+ 1" to make it fit
+    # like lgp_lookup_index() in C, -1 means the name can't have one
+    name = name.encode("utf-8") + b"\x00\x00"
+    value1 = _LOOKUP_VALUES[name[0]]
+    value2 = _LOOKUP_VALUES[name[1]]
+    if not 0 <= value1 < _LOOKUP_VALUE_MAX or not -1 <= value2 < _LOOKUP_VALUE_MAX:
+        return -1
+    return value1 * _LOOKUP_VALUE_MAX + value2 + 1
+
+def _parse_header(data):
+    if len(data) < 16:
+        raise EOFError("Unexpected EOF reached in archive header")
+    creator, num = (data[:12], int.from_bytes(data[12:16], "little"))
+    pointer = 16
+    toc = []
+    for i in range(num):
+        entry = data[pointer:pointer+27]
+        if len(entry) != 27:
+            raise EOFError("Unexpected EOF reached in ToC")
+        # a broken name must not keep the rest of the archive from being read
+        toc.append(_TocEntry(entry[:20].split(b"\x00")[0].decode("utf-8", "replace"),
+                             int.from_bytes(entry[20:24], "little"),
+                             entry[24],
+                             int.from_bytes(entry[25:27], "little")))
+        pointer += 27
+    table = data[pointer:pointer+_LOOKUP_TABLE_ENTRIES*4]
+    if len(table) != _LOOKUP_TABLE_ENTRIES * 4:
+        raise EOFError("Unexpected EOF reached in lookup table")
+    # each entry is the ToC index (plus one) of the first file, then a count
+    lookup = [(int.from_bytes(table[i:i+2], "little"),
+               int.from_bytes(table[i+2:i+4], "little"))
+              for i in range(0, len(table), 4)]
+    pointer += len(table)
+    if len(data) < pointer + 2:
+        raise EOFError("Unexpected EOF reached while reading conflicts")
+    conflicts = []
+    amount = int.from_bytes(data[pointer:pointer+2], "little")
+    pointer += 2
+    for i in range(amount):
+        if len(data) < pointer + 2:
+            raise EOFError("Unexpected EOF reached in conflicts table")
+        count = int.from_bytes(data[pointer:pointer+2], "little")
+        pointer += 2
+        entries = []
+        for j in range(count):
+            entry = data[pointer:pointer+130]
+            if len(entry) != 130:
+                raise EOFError("Unexpected EOF reached in conflicts parsing")
+            subdir = entry[:128].split(b"\x00")[0].decode("utf-8", "replace")
+            entries.append((subdir.replace("\\", "/"), int.from_bytes(entry[128:], "little")))
+            pointer += 130
+        conflicts.append(entries)
+
+    return _Header(creator, toc, lookup, conflicts, pointer)
+
+def _members(data, header):
+    # resolve each ToC entry into its full path and data size
+    subdirs = {}
+    for entries in header.conflicts:
+        for subdir, index in entries:
+            subdirs[index] = subdir
+    members = []
+    for i, entry in enumerate(header.toc):
+        path = entry.name
+        if entry.conflict and subdirs.get(i):
+            path = subdirs[i] + "/" + entry.name
+        size = int.from_bytes(data[entry.offset+20:entry.offset+24], "little")
+        members.append(_Member(i, entry.name, path, entry.offset, size))
+    return members
+
+def _map(file):
+    # map the archive read-only; the pages are shared with the OS file cache
+    with open(file, "rb") as f:
+        return mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+
+def _hash_members(data, members, workers=None):
+    view = memoryview(data)
+    def digest(member):
+        start = member.offset + 24
+        return hashlib.new(_MANIFEST_HASH, view[start:start+member.size]).hexdigest()
+    try:
+        with concurrent.futures.ThreadPoolExecutor(workers) as pool:
+            return dict(zip((m.path for m in members), pool.map(digest, members)))
+    finally:
+        view.release()
+
+def manifest(file, output=None, workers=None):
+    """Compute the checksum of every member of an archive.
+
+    The result maps each resolved member path to its hash, and is written
+    to 'output' as JSON if given. It can later be passed to verify()."""
+    with _map(file) as data:
+        header = _parse_header(data)
+        members = _members(data, header)
+        result = {"hash": _MANIFEST_HASH,
+                  "members": _hash_members(data, members, workers)}
+    if output is not None:
+        with open(output, "w") as f:
+            json.dump(result, f, indent=1, sort_keys=True)
+    return result
+
+def verify(file, manifest=None, workers=None):
+    """Check the structure of an archive, and optionally its contents.
+
+    This checks the ToC against the file headers, looks for out-of-bounds
+    and overlapping data, and makes sure the lookup and conflict tables are
+    consistent. If a manifest (a dict or the path to a JSON file created by
+    manifest()) is given, every member is also hashed and compared.
+    Returns a list of problems found; an empty list means it's valid."""
+    errors = []
+    with _map(file) as data:
+        try:
+            header = _parse_header(data)
+        except (EOFError, ValueError) as e:
+            return [str(e)]
+        num = len(header.toc)
+        members = []
+        for i, entry in enumerate(header.toc):
+            if entry.offset < header.size or entry.offset + 24 > len(data):
+                errors.append("%s: file header out of bounds (0x%x)" % (entry.name, entry.offset))
+                continue
+            name = data[entry.offset:entry.offset+20].split(b"\x00")[0].decode("utf-8", "replace")
+            if name != entry.name:
+                errors.append("%s: file header name mismatch (%s)" % (entry.name, name))
+            size = int.from_bytes(data[entry.offset+20:entry.offset+24], "little")
+            if entry.offset + 24 + size > len(data):
+                errors.append("%s: data out of bounds (0x%x + %i)" % (entry.name, entry.offset, size))
+                continue
+            members.append((entry.offset, entry.offset + 24 + size, entry.name))
+
+        # data blocks must not overlap each other, though several entries
+        # may point to the very same block
+        members.sort()
+        last = None
+        for start, end, name in members:
+            if last is not None and start < last[1] and (start, end) != last[:2]:
+                errors.append("%s: data overlaps with %s" % (name, last[2]))
+            if last is None or end > last[1]:
+                last = (start, end, name)
+
+        # every entry must be within the lookup range of its first two characters
+        if sum(count for toc_offset, count in header.lookup) != num:
+            errors.append("Lookup table does not account for all %i files" % num)
+        for i, entry in enumerate(header.toc):
+            index = _lookup_index(entry.name)
+            if not 0 <= index < _LOOKUP_TABLE_ENTRIES:
+                errors.append("%s: invalid name for the lookup table" % entry.name)
+                continue
+            toc_offset, count = header.lookup[index]
+            if not toc_offset - 1 <= i < toc_offset - 1 + count:
+                errors.append("%s: broken lookup table entry %i" % (entry.name, index))
+
+        resolved = set()
+        for group, entries in enumerate(header.conflicts, 1):
+            for subdir, index in entries:
+                if index >= num:
+                    errors.append("Conflict %i: ToC index %i out of range" % (group, index))
+                elif header.toc[index].conflict != group:
+                    errors.append("Conflict %i: %s is not part of it" % (group, header.toc[index].name))
+                else:
+                    resolved.add(index)
+        for i, entry in enumerate(header.toc):
+            if entry.conflict and i not in resolved:
+                errors.append("%s: unresolved conflict %i" % (entry.name, entry.conflict))
+
+        if manifest is not None and not errors:
+            if not isinstance(manifest, dict):
+                with open(manifest) as f:
+                    manifest = json.load(f)
+            if manifest.get("hash", _MANIFEST_HASH) != _MANIFEST_HASH:
+                errors.append("Unsupported manifest hash: %s" % manifest["hash"])
+                return errors
+            expected = manifest["members"]
+            hashes = _hash_members(data, _members(data, header), workers)
+            for path in sorted(expected.keys() | hashes.keys()):
+                if path not in hashes:
+                    errors.append("%s: missing from the archive" % path)
+                elif path not in expected:
+                    errors.append("%s: not in the manifest" % path)
+                elif hashes[path] != expected[path]:
+                    errors.append("%s: checksum mismatch" % path)
+
+    return errors
+
+def _find(data, patterns):
+    # every (offset, index) where one of the patterns is found in 'data'
+    if _lgp is not None:
+        return _lgp.find(data, patterns)
+    data = bytes(data)
+    hits = []
+    for index, pattern in enumerate(patterns):
+        offset = data.find(pattern)
+        while offset >= 0:
+            hits.append((offset, index))
+            offset = data.find(pattern, offset + 1)
+    return sorted(hits)
+
+def search(file, *patterns, include=None, exclude=None, workers=None):
+    """Find which members contain any of the given byte strings.
+
+    Strings are encoded to UTF-8. Members can be filtered like extract()
+    does, and are searched in place in the mapped archive, by a pool of
+    threads. Returns a list of (path, offset, pattern), 'offset' being
+    relative to the start of the member's data."""
+    patterns = [p.encode("utf-8") if isinstance(p, str) else bytes(p) for p in patterns]
+    if not patterns or not all(patterns):
+        raise ValueError("Empty search pattern")
+    with _map(file) as data:
+        members = _select(_members(data, _parse_header(data)), include, exclude)
+        members.sort(key=lambda m: m.offset)
+        # small members are grouped, so they don't cost a task each
+        batches = [[]]
+        size = 0
+        for member in members:
+            if size >= 4 << 20:
+                batches.append([])
+                size = 0
+            batches[-1].append(member)
+            size += member.size
+        view = memoryview(data)
+        def scan(batch):
+            hits = []
+            for member in batch:
+                start = member.offset + 24
+                with view[start:start+member.size] as chunk:
+                    hits.extend((member.path, offset, patterns[index])
+                                for offset, index in _find(chunk, patterns))
+            return hits
+        try:
+            with concurrent.futures.ThreadPoolExecutor(workers) as pool:
+                return [hit for hits in pool.map(scan, batches) for hit in hits]
+        finally:
+            view.release()
+
+def _texture(data, palette=0):
+    width, height, pixels = _lgp.decode_tex(data, palette)
+    return memoryview(pixels).cast("B", (height, width, 4))
+
+def decode_textures(file, include="*.tex", exclude=None, workers=None):
+    """Decode the TEX textures of an archive into RGBA pixels.
+
+    Returns a dict mapping each member's path to a memoryview of shape
+    (height, width, 4), which numpy.asarray() accepts without copying.
+    Textures are decoded in place in the mapped archive, by a pool of
+    threads. This needs the _lgp extension."""
+    if _lgp is None:
+        raise ImportError("Decoding textures needs the _lgp extension")
+    with _map(file) as data:
+        members = _select(_members(data, _parse_header(data)), include, exclude)
+        view = memoryview(data)
+        def decode(member):
+            start = member.offset + 24
+            with view[start:start+member.size] as chunk:
+                return _texture(chunk)
+        try:
+            with concurrent.futures.ThreadPoolExecutor(workers) as pool:
+                return dict(zip((m.path for m in members), pool.map(decode, members)))
+        finally:
+            view.release()
+
+def _copy_range(src, dst, offset, count):
+    # copy 'count' bytes at 'offset' in 'src' to the current position of 'dst'
+    # copy_file_range keeps the data in the kernel, and may even share blocks
+    while count:
+        if hasattr(os, "copy_file_range"):
+            try:
+                done = os.copy_file_range(src, dst, count, offset)
+            except OSError:
+                done = 0
+            if done:
+                offset += done
+                count -= done
+                continue
+        data = os.pread(src, min(count, 1 << 20), offset)
+        if not data:
+            raise EOFError("Unexpected EOF reached while copying data")
+        os.write(dst, data)
+        offset += len(data)
+        count -= len(data)
+
+def diff(old, new, workers=None):
+    """Compare the members of two archives by their resolved path.
+
+    Returns a dict with the "added", "removed", "changed" and "unchanged"
+    lists of paths. Members of the same size are compared by checksum."""
+    return _diff(old, new, workers)[0]
+
+def _diff(old, new, workers=None):
+    # diff(), along with the checksums of the old members it computed
+    with _map(old) as old_data, _map(new) as new_data:
+        old_members = {m.path: m for m in _members(old_data, _parse_header(old_data))}
+        new_members = {m.path: m for m in _members(new_data, _parse_header(new_data))}
+        # only hash what can't be told apart by its size alone
+        common = [path for path in new_members if path in old_members and
+                  old_members[path].size == new_members[path].size]
+        old_hashes = _hash_members(old_data, [old_members[p] for p in common], workers)
+        new_hashes = _hash_members(new_data, [new_members[p] for p in common], workers)
+
+    result = {"added": [], "removed": [], "changed": [], "unchanged": []}
+    for path in sorted(old_members.keys() | new_members.keys()):
+        if path not in new_members:
+            result["removed"].append(path)
+        elif path not in old_members:
+            result["added"].append(path)
+        elif path in common and old_hashes[path] == new_hashes[path]:
+            result["unchanged"].append(path)
+        else:
+            result["changed"].append(path)
+    return (result, old_hashes)
+
+# a patch holds the header region of the new archive, followed by a list of
+# operations rebuilding the data region sequentially:
+#   b"C" + offset (4 bytes) + length (4 bytes) + hash (16 bytes): copy a
+#        member of the old archive, whose data must have that hash
+#   b"D" + length (4 bytes) + data: insert new data
+#   b"E": end of the patch
+# the size of the old archive and a hash of its header guard against
+# applying a patch to an archive laid out differently, the hashes of the
+# copied members against one with other contents
+_PATCH_MAGIC = b"LGPPATC2"
+
+def _patch_hash(data):
+    return hashlib.new(_MANIFEST_HASH, data).digest()[:16]
+
+def make_patch(old, new, output, workers=None):
+    """Write a patch turning the 'old' archive into the 'new' one.
+
+    Only members that were added or changed are stored in the patch."""
+    changes, hashes = _diff(old, new, workers)
+    unchanged = set(changes["unchanged"])
+    with _map(old) as old_data, _map(new) as new_data, open(output, "wb") as f:
+        old_header = _parse_header(old_data)
+        old_members = {m.path: m for m in _members(old_data, old_header)}
+        new_header = _parse_header(new_data)
+        f.write(_PATCH_MAGIC)
+        f.write(len(old_data).to_bytes(8, "little"))
+        f.write(_patch_hash(old_data[:old_header.size]))
+        f.write(new_header.size.to_bytes(4, "little"))
+        f.write(new_data[:new_header.size])
+        pointer = new_header.size
+        for member in sorted(_members(new_data, new_header), key=lambda m: m.offset):
+            if member.offset < pointer:
+                # a block shared by several entries was already written
+                continue
+            if member.offset > pointer:
+                f.write(b"D" + (member.offset - pointer).to_bytes(4, "little"))
+                f.write(new_data[pointer:member.offset])
+            length = 24 + member.size
+            if member.path in unchanged:
+                f.write(b"C" + old_members[member.path].offset.to_bytes(4, "little"))
+                f.write(length.to_bytes(4, "little"))
+                f.write(bytes.fromhex(hashes[member.path])[:16])
+            else:
+                f.write(b"D" + length.to_bytes(4, "little"))
+                f.write(new_data[member.offset:member.offset+length])
+            pointer = member.offset + length
+        # anything left, such as the "FINAL FANTASY7" terminator
+        if pointer < len(new_data):
+            f.write(b"D" + (len(new_data) - pointer).to_bytes(4, "little"))
+            f.write(new_data[pointer:])
+        f.write(b"E")
+    return changes
+
+def apply(archive, patch, output=None):
+    """Apply a patch created by make_patch() to an archive.
+
+    The result is written to 'output', or replaces the archive if None.
+    Unchanged members are copied straight from the old archive."""
+    if output is None:
+        output = archive
+    # the output may be the archive itself, so it's only replaced at the end
+    target = "%s.%i.tmp" % (os.fspath(output), os.getpid())
+    with open(archive, "rb") as old, open(patch, "rb") as p, _map(archive) as old_data:
+        if p.read(len(_PATCH_MAGIC)) != _PATCH_MAGIC:
+            raise ValueError("'%s' is not an LGP patch" % patch)
+        size = int.from_bytes(p.read(8), "little")
+        digest = p.read(16)
+        old_header = _parse_header(old_data)
+        if len(old_data) != size or _patch_hash(old_data[:old_header.size]) != digest:
+            raise ValueError("Patch does not apply to '%s'" % archive)
+        try:
+            with open(target, "wb") as out:
+                out.write(p.read(int.from_bytes(p.read(4), "little")))
+                out.flush()
+                while True:
+                    op = p.read(1)
+                    if op == b"C":
+                        offset = int.from_bytes(p.read(4), "little")
+                        length = int.from_bytes(p.read(4), "little")
+                        # the member copied must be the one the patch was made with
+                        block = memoryview(old_data)[offset:offset+length]
+                        try:
+                            if (len(block) != length or length < 24 or
+                                int.from_bytes(block[20:24], "little") != length - 24 or
+                                _patch_hash(block[24:]) != p.read(16)):
+                                raise ValueError("Patch does not apply to '%s'" % archive)
+                        finally:
+                            block.release()
+                        _copy_range(old.fileno(), out.fileno(), offset, length)
+                    elif op == b"D":
+                        out.write(p.read(int.from_bytes(p.read(4), "little")))
+                        out.flush()
+                    elif op == b"E":
+                        break
+                    else:
+                        raise ValueError("Corrupted patch: '%s'" % patch)
+        except BaseException:
+            os.remove(target)
+            raise
+    os.replace(target, output)
+
+# limits of the format, the same as in the C extension
+_MAX_FILES = 65535
+_MAX_CONFLICTS = 4096
+_MAX_CONFLICT_ENTRIES = 255
+_MAX_ARCHIVE_SIZE = 0xFFFFFFFF
+# the longest name the C packer accepts, leaving room in the 20 byte ToC field
+_MAX_NAME_LENGTH = 15
+
+# a member to write: its path, its size, and where its data comes from,
+# which only means something to the function doing the copy
+_Input = collections.namedtuple("_Input", "path size source")
+
+def _layout(inputs):
+    # sort the inputs like the C packer does, and build the header region
+    # returns the header, and (name, resolved path, input) for each member in
+    # the order their data is written; only conflicts keep their subdirectory
+    keyed = []
+    for item in inputs:
+        subdir, _, name = item.path.replace("\\", "/").rpartition("/")
+        if len(name.encode("utf-8")) > _MAX_NAME_LENGTH:
+            raise ValueError("Filename too long: %s" % name)
+        bucket = _lookup_index(name)
+        if not 0 <= bucket < _LOOKUP_TABLE_ENTRIES:
+            raise ValueError("Invalid filename: %s" % name)
+        keyed.append(((bucket, name.lower(), name, subdir), subdir, name, item))
+    keyed.sort(key=lambda k: k[0])
+    if len(keyed) > _MAX_FILES:
+        raise OverflowError("Too many input files, an archive can hold at most %i" % _MAX_FILES)
+
+    # files with the same name (to FF7) are told apart by their subdirectory
+    groups = collections.defaultdict(list)
+    for i, (key, subdir, name, item) in enumerate(keyed):
+        groups[(key[0], key[1])].append(i)
+    conflict = [0] * len(keyed)
+    conflicts = []
+    for indices in groups.values():
+        if len(indices) < 2:
+            continue
+        if len(conflicts) == _MAX_CONFLICTS:
+            raise OverflowError("Too many conflicts, an archive can hold at most %i" % _MAX_CONFLICTS)
+        if len(indices) > _MAX_CONFLICT_ENTRIES:
+            raise OverflowError("Too many files named %s" % keyed[indices[0]][2])
+        for i in indices:
+            if len(keyed[i][1].encode("utf-8")) >= 128:
+                raise ValueError("Path too long: %s" % keyed[i][3].path)
+            if any(keyed[i][1].lower() == keyed[j][1].lower() for j in indices if j < i):
+                raise ValueError("Duplicate path: %s" % keyed[i][3].path)
+            conflict[i] = len(conflicts) + 1
+        conflicts.append(indices)
+
+    size = (16 + len(keyed) * 27 + _LOOKUP_TABLE_ENTRIES * 4 + 2 +
+            sum(2 + 130 * len(indices) for indices in conflicts))
+    offset = size
+    header = bytearray(b"\x00\x00SQUARESOFT" + len(keyed).to_bytes(4, "little"))
+    lookup = [[0, 0] for i in range(_LOOKUP_TABLE_ENTRIES)]
+    for i, (key, subdir, name, item) in enumerate(keyed):
+        if offset > _MAX_ARCHIVE_SIZE:
+            raise OverflowError("Archive too large, offsets can't exceed 4 GB")
+        header += struct.pack("<20sIBH", name.encode("utf-8"), offset, 14, conflict[i])
+        if not lookup[key[0]][1]:
+            lookup[key[0]][0] = i + 1
+        lookup[key[0]][1] += 1
+        offset += 24 + item.size
+    for toc_offset, count in lookup:
+        header += struct.pack("<HH", toc_offset, count)
+    header += len(conflicts).to_bytes(2, "little")
+    for indices in conflicts:
+        header += len(indices).to_bytes(2, "little")
+        for i in indices:
+            header += struct.pack("<128sH", keyed[i][1].encode("utf-8"), i)
+
+    return (bytes(header), [(name, subdir + "/" + name if conflict[i] and subdir else name, item)
+                            for i, (key, subdir, name, item) in enumerate(keyed)])
+
+def _write_archive(output, layout, copy, replace=True):
+    # write a whole archive laid out by _layout(); copy(source, out, size)
+    # appends a member's data to the output file object, flushed just before
+    # the output may be one of the inputs, so a temporary file is written and
+    # moved over it at the end; without 'replace', its path is returned for
+    # the caller to move once the inputs are closed
+    header, members = layout
+    target = "%s.%i.tmp" % (os.fspath(output), os.getpid())
+    try:
+        with open(target, "wb") as out:
+            out.write(header)
+            for name, path, item in members:
+                out.write(struct.pack("<20sI", name.encode("utf-8"), item.size))
+                out.flush()
+                copy(item.source, out, item.size)
+            out.write(b"FINAL FANTASY7")
+    except BaseException:
+        os.remove(target)
+        raise
+    if not replace:
+        return target
+    os.replace(target, output)
+
+def merge(output, *archives, policy="last-wins"):
+    """Merge several archives into a new one, without extracting them.
+
+    When more than one archive has the same path, 'policy' decides what
+    happens: with "last-wins", the one given last is kept, like LGPSet
+    does; with "keep-both", every one is kept, the later ones moved into
+    a subdirectory named after their archive, so they end up in the
+    conflicts table. Member data is copied straight between the files."""
+    if policy not in ("last-wins", "keep-both"):
+        raise ValueError("Unknown merge policy: %s" % policy)
+    files = []
+    try:
+        chosen = {}
+        for archive in archives:
+            f = open(archive, "rb")
+            files.append(f)
+            with _map(archive) as data:
+                members = _members(data, _parse_header(data))
+            prefix = os.path.splitext(os.path.basename(archive))[0]
+            for member in members:
+                path = member.path
+                if policy == "keep-both" and _fold(path) in chosen:
+                    path = prefix + "/" + path
+                    if _fold(path) in chosen:
+                        raise ValueError("Duplicate path: %s" % path)
+                chosen[_fold(path)] = _Input(path, member.size, (f.fileno(), member.offset + 24))
+        target = _write_archive(output, _layout(chosen.values()),
+                                lambda source, out, size: _copy_range(source[0], out.fileno(), source[1], size),
+                                replace=False)
+    finally:
+        for f in files:
+            f.close()
+    os.replace(target, output)
+
+class StatCache:
+    """Hashes of files on disk, kept for as long as they don't change.
+
+    A file is considered unchanged while its device, inode, modification
+    time and size stay the same, so it isn't read again to be hashed.
+    The hashes of the members of archives are kept the same way, for as
+    long as the archive itself doesn't change.
+    The cache is kept in the JSON file 'path', if given, from one run to
+    the next; save() writes it back."""
+
+    def __init__(self, path=None):
+        self.path = path
+        self._files = {}
+        self._archives = {}
+        if path is not None and os.path.isfile(path):
+            with open(path) as f:
+                cache = json.load(f)
+            if cache.get("hash") == _MANIFEST_HASH:
+                self._files = cache["files"]
+                self._archives = cache.get("archives", {})
+
+    def members(self, archive, workers=None):
+        """Return the hashes of an archive's members, by resolved path."""
+        st = os.stat(archive)
+        key = [st.st_dev, st.st_ino, st.st_mtime_ns, st.st_size]
+        cached = self._archives.get(os.path.abspath(archive))
+        if cached is not None and cached["key"] == key:
+            return cached["members"]
+        with _map(archive) as data:
+            hashes = _hash_members(data, _members(data, _parse_header(data)), workers)
+        self.record(archive, hashes)
+        return hashes
+
+    def record(self, archive, hashes):
+        """Remember the hashes of the members of an archive just written."""
+        st = os.stat(archive)
+        self._archives[os.path.abspath(archive)] = {
+            "key": [st.st_dev, st.st_ino, st.st_mtime_ns, st.st_size],
+            "members": hashes}
+
+    def hash(self, file, st=None):
+        """Return the hash of a file, computing it only if it changed."""
+        file = os.path.abspath(file)
+        if st is None:
+            st = os.stat(file)
+        key = [st.st_dev, st.st_ino, st.st_mtime_ns, st.st_size]
+        cached = self._files.get(file)
+        if cached is not None and cached[:4] == key:
+            return cached[4]
+        digest = hashlib.new(_MANIFEST_HASH)
+        with open(file, "rb") as f:
+            for chunk in iter(lambda: f.read(1 << 20), b""):
+                digest.update(chunk)
+        self._files[file] = key + [digest.hexdigest()]
+        return digest.hexdigest()
+
+    def save(self):
+        if self.path is None:
+            return
+        with open(self.path + ".tmp", "w") as f:
+            json.dump({"hash": _MANIFEST_HASH, "files": self._files,
+                       "archives": self._archives}, f)
+        os.replace(self.path + ".tmp", self.path)
+
+def _read_manifest(manifest):
+    # one "archive path<TAB>source path[<TAB>hash]" per line, like the
+    # .parts files the C packer writes; sources are relative to the manifest
+    # a directory stands for every file in it, under its relative path
+    if not isinstance(manifest, (str, os.PathLike)):
+        return [tuple(entry) + (None,) * (3 - len(entry)) for entry in manifest]
+    if os.path.isdir(manifest):
+        entries = []
+        for root, dirs, files in os.walk(manifest):
+            for name in files:
+                source = os.path.join(root, name)
+                path = os.path.relpath(source, manifest).replace(os.sep, "/")
+                entries.append((path, source, None))
+        return entries
+    base = os.path.dirname(os.path.abspath(manifest))
+    entries = []
+    with open(manifest, encoding="utf-8") as f:
+        for line in f:
+            line = line.rstrip("\r\n")
+            if not line or line.startswith("#"):
+                continue
+            fields = line.split("\t")
+            if len(fields) not in (2, 3):
+                raise ValueError("Invalid manifest line: %s" % line)
+            entries.append((fields[0], os.path.join(base, fields[1]),
+                            fields[2] if len(fields) == 3 else None))
+    return entries
+
+def pack(manifest, output, cache=None, base=None):
+    """Pack the files listed in a manifest into a new archive.
+
+    The manifest is a file, a list of (archive path, source path) or
+    (archive path, source path, hash) tuples, or a directory to pack
+    whole. Nothing else is looked at, so there's no directory tree to
+    walk or to stage beforehand. When a hash is given, the source must
+    match it; 'cache' is the path of a StatCache file, which spares
+    hashing the sources that didn't change since the last time.
+    'base' is a previous archive: the members it already has with the
+    same path and contents are copied from it rather than read from the
+    sources. With a cache, the contents are compared by hash, and telling
+    which ones didn't change only costs a stat() of each source. Without
+    one, a member of the same size is taken as unchanged if its source
+    wasn't modified after the base, like make does. Either way, the time
+    spent depends on the changes."""
+    stats = StatCache(cache)
+    inputs = []
+    mtimes = {}
+    for path, source, digest in _read_manifest(manifest):
+        st = os.stat(source)
+        if digest is not None and stats.hash(source, st) != digest.lower():
+            raise ValueError("%s: checksum mismatch" % source)
+        inputs.append(_Input(path, st.st_size, source))
+        mtimes[source] = st.st_mtime_ns
+    layout = _layout(inputs)
+
+    with contextlib.ExitStack() as stack:
+        old = {}
+        old_hashes = {}
+        if base is not None:
+            f = stack.enter_context(open(base, "rb"))
+            with _map(base) as data:
+                old = {_fold(m.path): m for m in _members(data, _parse_header(data))}
+            if cache is not None:
+                old_hashes = {_fold(path): digest for path, digest in stats.members(base).items()}
+            base_mtime = os.fstat(f.fileno()).st_mtime_ns
+
+        # reused members are read from the base, at the offset of their data
+        hashes = {}
+        members = []
+        for name, path, item in layout[1]:
+            member = old.get(_fold(path))
+            if cache is not None:
+                hashes[path] = stats.hash(item.source)
+            if member is not None and member.size == item.size:
+                if cache is not None:
+                    unchanged = old_hashes.get(_fold(path)) == hashes[path]
+                else:
+                    unchanged = mtimes[item.source] < base_mtime
+                if unchanged:
+                    item = item._replace(source=(f.fileno(), member.offset + 24))
+            members.append((name, path, item))
+
+        def copy(source, out, size):
+            if isinstance(source, tuple):
+                _copy_range(source[0], out.fileno(), source[1], size)
+                return
+            with open(source, "rb") as f:
+                _copy_range(f.fileno(), out.fileno(), 0, size)
+        # the base may well be the archive being replaced
+        target = _write_archive(output, (layout[0], members), copy, replace=False)
+
+    os.replace(target, output)
+    if cache is not None:
+        stats.record(output, hashes)
+    stats.save()
+
+def _copy_stream(src, dst, size):
+    # copy 'size' bytes between two file objects, a block at a time
+    while size:
+        data = src.read(min(size, 1 << 20))
+        if not data:
+            raise EOFError("Unexpected EOF reached while copying data")
+        dst.write(data)
+        size -= len(data)
+
+def _sorted_members(file):
+    # the members of an archive in the order of their data, and its mtime
+    with _map(file) as data:
+        members = _members(data, _parse_header(data))
+    return (sorted(members, key=lambda m: m.offset), int(os.stat(file).st_mtime))
+
+def to_tar(file, output, compression=""):
+    """Convert an archive to tar, written strictly sequentially to 'output'.
+
+    'output' is a path or any object with a write() method. Members are
+    stored under their resolved paths, in the order of their data, and
+    'compression' may be "gz", "bz2" or "xz". Memory use doesn't depend on
+    the size of the archive."""
+    members, mtime = _sorted_members(file)
+    with open(file, "rb") as f:
+        if hasattr(output, "write"):
+            tar = tarfile.open(fileobj=output, mode="w|" + compression)
+        else:
+            tar = tarfile.open(output, mode="w|" + compression)
+        with tar:
+            for member in members:
+                info = tarfile.TarInfo(member.path)
+                info.size = member.size
+                info.mtime = mtime
+                info.mode = 0o644
+                f.seek(member.offset + 24)
+                tar.addfile(info, f)
+
+def to_zip(file, output, compression=zipfile.ZIP_STORED):
+    """Convert an archive to zip, written to 'output'.
+
+    'output' is a path or any object with a write() method; it doesn't
+    need to be seekable. Members are stored under their resolved paths,
+    in the order of their data, uncompressed unless told otherwise."""
+    members, mtime = _sorted_members(file)
+    date = time.localtime(max(mtime, 315532800))[:6]
+    with open(file, "rb") as f, zipfile.ZipFile(output, "w", compression) as zf:
+        for member in members:
+            info = zipfile.ZipInfo(member.path, date)
+            info.compress_type = compression
+            info.file_size = member.size
+            info.external_attr = 0o644 << 16
+            f.seek(member.offset + 24)
+            with zf.open(info, "w") as w:
+                _copy_stream(f, w, member.size)
+
+def from_tar(source, output):
+    """Pack the regular files of a tar archive into a new LGP archive.
+
+    Nothing is extracted to disk: the tar headers are read first to lay
+    out the archive, then each member's data is copied over. For an
+    uncompressed tar, the copy is done by the kernel. A compressed tar
+    can't be read out of order without decompressing it again from the
+    start for every member, so it's read twice from start to end: once
+    for the headers, and once for the data, each written in its place."""
+    try:
+        tar = tarfile.open(source, "r:")
+    except tarfile.ReadError:
+        tar = None
+    if tar is not None:
+        with tar:
+            inputs = [_Input(info.name, info.size, info) for info in tar if info.isreg()]
+            def copy(info, out, size):
+                if not info.sparse:
+                    _copy_range(tar.fileobj.fileno(), out.fileno(), info.offset_data, size)
+                else:
+                    _copy_stream(tar.extractfile(info), out, size)
+            _write_archive(output, _layout(inputs), copy)
+        return
+
+    with tarfile.open(source, "r|*") as tar:
+        inputs = [_Input(info.name, info.size, i)
+                  for i, info in enumerate(info for info in tar if info.isreg())]
+    # the data is left out for now, only its place is kept
+    offsets = [None] * len(inputs)
+    def skip(i, out, size):
+        offsets[i] = out.tell()
+        out.seek(size, os.SEEK_CUR)
+    target = _write_archive(output, _layout(inputs), skip, replace=False)
+    try:
+        with tarfile.open(source, "r|*") as tar, open(target, "r+b") as out:
+            count = 0
+            for info in tar:
+                if not info.isreg():
+                    continue
+                if count == len(offsets) or info.size != inputs[count].size:
+                    raise ValueError("'%s' changed while being read" % source)
+                out.seek(offsets[count])
+                _copy_stream(tar.extractfile(info), out, info.size)
+                count += 1
+            if count != len(offsets):
+                raise ValueError("'%s' changed while being read" % source)
+    except BaseException:
+        os.remove(target)
+        raise
+    os.replace(target, output)
+
+def from_zip(source, output):
+    """Pack the files of a zip archive into a new LGP archive.
+
+    Members are decompressed on the fly, a block at a time, straight into
+    the new archive; nothing is extracted to disk."""
+    with zipfile.ZipFile(source) as zf:
+        inputs = [_Input(info.filename, info.file_size, info)
+                  for info in zf.infolist() if not info.is_dir()]
+        def copy(info, out, size):
+            with zf.open(info) as src:
+                _copy_stream(src, out, size)
+        _write_archive(output, _layout(inputs), copy)
+
+def _read_exact(stream, size):
+    data = stream.read(size)
+    if len(data) == size:
+        return data
+    data = bytearray(data)
+    while len(data) < size:
+        chunk = stream.read(size - len(data))
+        if not chunk:
+            raise EOFError("Unexpected EOF reached in stream")
+        data += chunk
+    return bytes(data)
+
+class _StreamWindow:
+    # a stream read up to 'pointer', with at most its last 'spill' bytes kept
+
+    def __init__(self, stream, pointer, spill):
+        self.stream = stream
+        self.pointer = pointer
+        self.spill = spill
+        self.window = bytearray()
+
+    def _keep(self, data):
+        if len(data) >= self.spill:
+            self.window = bytearray(data[len(data)-self.spill:])
+        else:
+            self.window += data
+            del self.window[:max(len(self.window) - self.spill, 0)]
+        self.pointer += len(data)
+
+    def _read(self, size):
+        chunk = self.stream.read(min(size, 1 << 20))
+        if not chunk:
+            raise EOFError("Unexpected EOF reached in stream")
+        self._keep(chunk)
+        return chunk
+
+    def _skip(self, offset):
+        while self.pointer < offset:
+            self._read(offset - self.pointer)
+
+    def chunks(self, offset, size):
+        """Yield the 'size' bytes at 'offset', a piece at a time."""
+        self._skip(offset)
+        if offset < self.pointer:
+            start = len(self.window) - (self.pointer - offset)
+            if start < 0:
+                raise ValueError("Data at 0x%x is too far back in the stream" % offset)
+            data = bytes(self.window[start:start+size])
+            offset += len(data)
+            size -= len(data)
+            yield data
+        while size:
+            chunk = self._read(size)
+            size -= len(chunk)
+            yield chunk
+
+    def read(self, offset, size):
+        """Return the 'size' bytes at 'offset'."""
+        self._skip(offset)
+        if offset < self.pointer:
+            return b"".join(self.chunks(offset, size))
+        # read in one go, rather than copied again out of pieces
+        data = _read_exact(self.stream, size)
+        self._keep(data)
+        return data
+
+def _stream_members(stream, spill):
+    # yield (path, data offset, size, window) for each member, by offset
+    # read just as much as needed to know how big the header is
+    header = bytearray(_read_exact(stream, 16))
+    num = int.from_bytes(header[12:16], "little")
+    header += _read_exact(stream, num * 27 + _LOOKUP_TABLE_ENTRIES * 4 + 2)
+    for i in range(int.from_bytes(header[-2:], "little")):
+        header += _read_exact(stream, 2)
+        header += _read_exact(stream, int.from_bytes(header[-2:], "little") * 130)
+    header = _parse_header(bytes(header))
+
+    subdirs = {}
+    for entries in header.conflicts:
+        for subdir, index in entries:
+            subdirs[index] = subdir
+
+    window = _StreamWindow(stream, header.size, spill)
+    order = sorted(range(num), key=lambda i: header.toc[i].offset)
+    for i in order:
+        entry = header.toc[i]
+        size = int.from_bytes(window.read(entry.offset, 24)[20:], "little")
+        path = entry.name
+        if entry.conflict and subdirs.get(i):
+            path = subdirs[i] + "/" + entry.name
+        yield (path, entry.offset + 24, size, window)
+
+def iter_stream(stream, spill=16 << 20):
+    """Read an archive from a non-seekable stream, in a single pass.
+
+    Yields (path, data) for each member as its bytes go by. Members are
+    read in the order of their offsets, whatever the order of the ToC.
+    Besides the header and the member being yielded, the last 'spill'
+    bytes read are kept around, for the members sharing or overlapping
+    data with a previous one; reaching further back than that raises
+    ValueError."""
+    for path, offset, size, window in _stream_members(stream, spill):
+        yield (path, window.read(offset, size))
+
+def extract_stream(stream, folder, spill=16 << 20):
+    """Extract an archive read from a non-seekable stream into 'folder'.
+
+    Members are copied to their files a block at a time, so only the
+    header and the last 'spill' bytes read are kept, as in iter_stream()."""
+    for path, offset, size, window in _stream_members(stream, spill):
+        target = os.path.join(folder, *path.split("/"))
+        os.makedirs(os.path.dirname(target), exist_ok=True)
+        with open(target, "wb") as w:
+            for chunk in window.chunks(offset, size):
+                w.write(chunk)
+
+class LGPSet:
+    """Several archives seen as a single namespace.
+
+    Members are looked up by their resolved path, regardless of case, in
+    one merged index. When more than one archive has the same path, the
+    one given last wins, so mod archives can be overlaid on top of the
+    game's ones.
+    Archives are mapped in memory, and read() returns a memoryview into
+    the mapping; it must be released before the set is closed."""
+
+    def __init__(self, *archives):
+        self.archives = []
+        self._maps = []
+        self._index = {}
+        for archive in archives:
+            self.add(archive)
+
+    def add(self, archive):
+        """Add an archive on top of the others."""
+        data = _map(archive)
+        try:
+            members = _members(data, _parse_header(data))
+        except BaseException:
+            data.close()
+            raise
+        num = len(self.archives)
+        self.archives.append(archive)
+        self._maps.append(data)
+        for member in members:
+            self._index[_fold(member.path)] = (num, member)
+
+    def find(self, path):
+        """Return the archive holding 'path', and the member itself."""
+        num, member = self._index[_fold(path)]
+        return (self.archives[num], member)
+
+    def read(self, path):
+        num, member = self._index[_fold(path)]
+        start = member.offset + 24
+        return memoryview(self._maps[num])[start:start+member.size]
+
+    def __contains__(self, path):
+        return _fold(path) in self._index
+
+    def __iter__(self):
+        return (member.path for num, member in self._index.values())
+
+    def __len__(self):
+        return len(self._index)
+
+    def close(self):
+        for data in self._maps:
+            data.close()
+        self._maps.clear()
+        self._index.clear()
+        self.archives.clear()
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *exc):
+        self.close()
+
+# FF7 looks names up regardless of case, and so do the indices below
+# only ASCII letters are folded, like the game does
+def _fold(path):
+    return path.replace("\\", "/").encode("utf-8").lower()
+
+def _name_hash(key, seed=0):
+    # one hash gives the bucket and the two values used to place the key;
+    # another seed gives other values, for when the keys can't be placed
+    digest = hashlib.blake2b(key, digest_size=16, salt=seed.to_bytes(16, "little")).digest()
+    return (int.from_bytes(digest[:4], "little"),
+            int.from_bytes(digest[4:8], "little"),
+            int.from_bytes(digest[8:], "little"))
+
+def _perfect_slot(hashes, displacement, size):
+    h1, h2, h3 = hashes
+    return (h2 + (displacement // size) * h3 + displacement % size) % size
+
+def _free_slots(taken, start, end):
+    slot = taken.find(0, start, end)
+    while slot != -1:
+        yield slot
+        slot = taken.find(0, slot + 1, end)
+
+def _perfect_hash(keys):
+    """Build a minimal perfect hash of 'keys', CHD style.
+
+    Keys are spread over buckets of about 2 keys each, then the largest
+    buckets are placed first, each one getting the first displacement
+    that puts all of its keys in free slots. When a bucket can't be
+    placed, it starts over with the next seed. Returns the seed, the
+    displacement of each bucket and the slot of each key."""
+    for seed in itertools.count():
+        placed = _place_keys(keys, seed)
+        if placed is not None:
+            return (seed,) + placed
+
+def _place_keys(keys, seed):
+    # the CHD placement of _perfect_hash() for one seed, or None
+    size = len(keys)
+    buckets = [[] for i in range((size + 1) // 2 or 1)]
+    hashes = [_name_hash(key, seed) for key in keys]
+    for i, h in enumerate(hashes):
+        buckets[h[0] % len(buckets)].append(i)
+    displacements = [0] * len(buckets)
+    slots = [None] * size
+    taken = bytearray(size)
+    for bucket in sorted(range(len(buckets)), key=lambda b: -len(buckets[b])):
+        items = buckets[bucket]
+        if not items:
+            continue
+        # a displacement is (d0 * size + d1); for a given d0, try each d1
+        # in order that moves the first key to a free slot, until the rest
+        # fits too (starting at d1 = 0 keeps the free slots evenly spread)
+        # positions repeat once d0 reaches the size, there's no point going on
+        for d0 in range(size):
+            bases = [(hashes[i][1] + d0 * hashes[i][2]) % size for i in items]
+            targets = itertools.chain(_free_slots(taken, bases[0], size), _free_slots(taken, 0, bases[0]))
+            for target in targets:
+                d1 = (target - bases[0]) % size
+                positions = [(base + d1) % size for base in bases]
+                if len(set(positions)) == len(positions) and not any(taken[p] for p in positions):
+                    break
+            else:
+                continue
+            break
+        else:
+            return None
+        displacements[bucket] = d0 * size + d1
+        for i, position in zip(items, positions):
+            slots[i] = position
+            taken[position] = 1
+    return (displacements, slots)
+
+# the index sidecar holds the parsed archive in a position-independent
+# layout, so it can be mapped read-only and shared between processes:
+#   header: magic, version, number of members, archive size and mtime,
+#           the offsets of the entries, strings and hash regions, then the
+#           number of buckets and of distinct names in the hash
+#   entries: one per member, sorted by resolved path (encoded in utf-8)
+#            path offset and length in the strings region, then the
+#            member's ToC index, file header offset and data size
+#   strings: all the resolved paths, back to back
+#   hash: a minimal perfect hash of the lowercase paths; the displacement
+#         of each bucket, then the entry found at each slot; the seed it was
+#         built with is the last field of the header
+_INDEX_MAGIC = b"LGPINDEX"
+_INDEX_VERSION = 3
+_INDEX_HEADER = struct.Struct("<8sIIQQIIIIII")
+_INDEX_ENTRY = struct.Struct("<IIIII")
+
+def _index_stamp(archive):
+    st = os.stat(archive)
+    return (st.st_size, st.st_mtime_ns)
+
+def build_index(archive, output=None):
+    """Write the index sidecar of an archive, by default to '<archive>.idx'.
+
+    The file is written under a temporary name, then renamed, so that
+    other processes never see it half-written."""
+    if output is None:
+        output = archive + ".idx"
+    size, mtime = _index_stamp(archive)
+    with _map(archive) as data:
+        members = _members(data, _parse_header(data))
+    members.sort(key=lambda m: m.path.encode("utf-8"))
+    strings = bytearray()
+    entries = bytearray()
+    keys = {}
+    for i, member in enumerate(members):
+        path = member.path.encode("utf-8")
+        entries += _INDEX_ENTRY.pack(len(strings), len(path), member.index, member.offset, member.size)
+        strings += path
+        # paths only differing by their case can't both be found
+        keys.setdefault(_fold(member.path), i)
+    seed, displacements, slots = _perfect_hash(list(keys))
+    table = [0] * len(keys)
+    for slot, i in zip(slots, keys.values()):
+        table[slot] = i
+    perfect = b"".join(d.to_bytes(4, "little") for d in displacements + table)
+    start = _INDEX_HEADER.size
+    header = _INDEX_HEADER.pack(_INDEX_MAGIC, _INDEX_VERSION, len(members), size, mtime,
+                                start, start + len(entries), start + len(entries) + len(strings),
+                                len(displacements), len(keys), seed)
+    temp = "%s.%i.tmp" % (output, os.getpid())
+    with open(temp, "wb") as f:
+        f.write(header + entries + strings + perfect)
+    os.replace(temp, output)
+    return output
+
+class SharedIndex:
+    """A read-only view of an archive through its index sidecar.
+
+    Both the index and the archive are mapped read-only, so any number of
+    processes opening the same files share a single copy of them in the
+    page cache. Lookups ignore case and take a single probe into the
+    perfect hash stored in the index, and nothing is parsed in the process
+    itself. Put the index in /dev/shm to keep it in shared memory. It is
+    (re)built if missing or out of date."""
+
+    def __init__(self, archive, index=None):
+        if index is None:
+            index = archive + ".idx"
+        self.archive = archive
+        self._data = _map(archive)
+        try:
+            self._index = None
+            if os.path.isfile(index):
+                self._index = _map(index)
+            if not self._valid(archive):
+                if self._index is not None:
+                    self._index.close()
+                self._index = _map(build_index(archive, index))
+            (magic, version, self._count, size, mtime, self._entries,
+             self._strings, self._hash, self._buckets, self._keys, self._seed) = _INDEX_HEADER.unpack_from(self._index)
+        except BaseException:
+            self.close()
+            raise
+
+    def _valid(self, archive):
+        if self._index is None or len(self._index) < _INDEX_HEADER.size:
+            return False
+        magic, version, count, size, mtime = _INDEX_HEADER.unpack_from(self._index)[:5]
+        return (magic == _INDEX_MAGIC and version == _INDEX_VERSION and
+                (size, mtime) == _index_stamp(archive))
+
+    def _entry(self, i):
+        start, length, index, offset, size = _INDEX_ENTRY.unpack_from(
+                self._index, self._entries + i * _INDEX_ENTRY.size)
+        start += self._strings
+        return (self._index[start:start+length], index, offset, size)
+
+    def _search(self, path):
+        if self._keys:
+            key = _fold(path)
+            hashes = _name_hash(key, self._seed)
+            pointer = self._hash + (hashes[0] % self._buckets) * 4
+            displacement = int.from_bytes(self._index[pointer:pointer+4], "little")
+            pointer = self._hash + (self._buckets + _perfect_slot(hashes, displacement, self._keys)) * 4
+            entry = self._entry(int.from_bytes(self._index[pointer:pointer+4], "little"))
+            # any name lands on some slot, make sure it's the right one
+            if entry[0].lower() == key:
+                return entry
+        raise KeyError(path)
+
+    def find(self, path):
+        path, index, offset, size = self._search(path)
+        name = path.rsplit(b"/", 1)[-1].decode("utf-8")
+        return _Member(index, name, path.decode("utf-8"), offset, size)
+
+    def read(self, path):
+        path, index, offset, size = self._search(path)
+        return memoryview(self._data)[offset+24:offset+24+size]
+
+    def __contains__(self, path):
+        try:
+            self._search(path)
+        except KeyError:
+            return False
+        return True
+
+    def __iter__(self):
+        for i in range(self._count):
+            yield self._entry(i)[0].decode("utf-8")
+
+    def __len__(self):
+        return self._count
+
+    def close(self):
+        for data in (getattr(self, "_index", None), self._data):
+            if data is not None:
+                data.close()
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *exc):
+        self.close()
+
+class LGPFileSystem:
+    """A read-only filesystem view of one or more archives.
+
+    The operations mirror the FUSE ones (paths are absolute, using "/")
+    and are served straight from an LGPSet, conflict subdirectories
+    being real directories. Missing paths raise FileNotFoundError.
+    mount() hands them over to a backend, which is fusepy by default."""
+
+    def __init__(self, *archives):
+        self.archives = LGPSet(*archives)
+        self._dirs = {"": set()}
+        for path in self.archives:
+            parent = ""
+            for part in path.split("/"):
+                self._dirs[parent].add(part)
+                parent = (parent + "/" + part).lstrip("/")
+                self._dirs.setdefault(parent, set())
+            # the last part was a file, not a directory
+            if not self._dirs[parent]:
+                del self._dirs[parent]
+        self._mtime = max([os.stat(archive).st_mtime for archive in archives] or [0])
+
+    def getattr(self, path):
+        path = path.strip("/")
+        attrs = {"st_mtime": self._mtime, "st_ctime": self._mtime,
+                 "st_atime": self._mtime, "st_uid": os.getuid() if hasattr(os, "getuid") else 0,
+                 "st_gid": os.getgid() if hasattr(os, "getgid") else 0}
+        if path in self._dirs:
+            attrs.update(st_mode=stat.S_IFDIR | 0o555, st_nlink=2, st_size=0)
+        elif path in self.archives:
+            attrs.update(st_mode=stat.S_IFREG | 0o444, st_nlink=1,
+                         st_size=self.archives.find(path)[1].size)
+        else:
+            raise FileNotFoundError(errno.ENOENT, "No such file or directory", path)
+        return attrs
+
+    def readdir(self, path):
+        path = path.strip("/")
+        if path not in self._dirs:
+            raise FileNotFoundError(errno.ENOENT, "No such file or directory", path)
+        return [".", ".."] + sorted(self._dirs[path])
+
+    def read(self, path, size, offset):
+        path = path.strip("/")
+        if path not in self.archives:
+            raise FileNotFoundError(errno.ENOENT, "No such file or directory", path)
+        data = self.archives.read(path)
+        try:
+            return bytes(data[offset:offset+size])
+        finally:
+            data.release()
+
+    def close(self):
+        self.archives.close()
+
+def _fusepy_backend(filesystem, mountpoint):
+    import fuse
+
+    class Operations(fuse.Operations):
+        def __call__(self, op, *args):
+            try:
+                return super().__call__(op, *args)
+            except FileNotFoundError:
+                raise fuse.FuseOSError(errno.ENOENT)
+
+        def getattr(self, path, fh=None):
+            return filesystem.getattr(path)
+
+        def readdir(self, path, fh):
+            return filesystem.readdir(path)
+
+        def read(self, path, size, offset, fh):
+            return filesystem.read(path, size, offset)
+
+    fuse.FUSE(Operations(), mountpoint, foreground=True, ro=True)
+
+def mount(mountpoint, *archives, backend=_fusepy_backend):
+    """Serve the archives' contents as a read-only directory tree.
+
+    'backend' is called with the LGPFileSystem and the mount point, and
+    runs until the filesystem is unmounted."""
+    filesystem = LGPFileSystem(*archives)
+    try:
+        backend(filesystem, mountpoint)
+    finally:
+        filesystem.close()
+
+_RANGE = re.compile(r"bytes=(\d*)-(\d*)$")
+
+def _http_range(header, size):
+    # only single byte ranges are supported; other units, lists of ranges
+    # and invalid ones are ignored (None) so the whole member is sent, as
+    # RFC 7233 allows, while False means the range can't be satisfied
+    match = _RANGE.match(header.strip())
+    if not match or match.groups() == ("", ""):
+        return None
+    start, end = match.groups()
+    if not start:
+        start, end = (max(size - int(end), 0), size - 1 if int(end) else -1)
+    elif end and int(end) < int(start):
+        return None
+    else:
+        start, end = (int(start), min(int(end), size - 1) if end else size - 1)
+    if start > end:
+        return False
+    return (start, end)
+
+async def _http_client(archives, reader, writer):
+    loop = asyncio.get_running_loop()
+    try:
+        while True:
+            try:
+                request = await reader.readuntil(b"\r\n\r\n")
+            except (asyncio.IncompleteReadError, asyncio.LimitOverrunError):
+                break
+            lines = request.decode("latin-1").split("\r\n")
+            try:
+                method, target, version = lines[0].split(" ")
+            except ValueError:
+                writer.write(b"HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\nConnection: close\r\n\r\n")
+                break
+            headers = {}
+            for line in lines[1:]:
+                if ":" in line:
+                    key, value = line.split(":", 1)
+                    headers[key.strip().lower()] = value.strip()
+            keep_alive = headers.get("connection", "").lower() != "close" and version == "HTTP/1.1"
+
+            status, response, member = ("200 OK", {}, None)
+            archive, _, path = urllib.parse.unquote(target.split("?")[0]).lstrip("/").partition("/")
+            if method not in ("GET", "HEAD"):
+                status, response["Allow"] = ("405 Method Not Allowed", "GET, HEAD")
+            elif archive not in archives or path not in archives[archive]:
+                status = "404 Not Found"
+            else:
+                member = archives[archive].find(path)[1]
+                start, end = (0, member.size - 1)
+                response["ETag"] = etag = '"%x-%x"' % (member.offset, member.size)
+                response["Accept-Ranges"] = "bytes"
+                response["Content-Type"] = "application/octet-stream"
+                if headers.get("if-none-match") == etag:
+                    status, member = ("304 Not Modified", None)
+                elif "range" in headers and headers.get("if-range", etag) == etag:
+                    ranges = _http_range(headers["range"], member.size)
+                    if ranges is False:
+                        response["Content-Range"] = "bytes */%i" % member.size
+                        status, member = ("416 Range Not Satisfiable", None)
+                    elif ranges:
+                        start, end = ranges
+                        status = "206 Partial Content"
+                        response["Content-Range"] = "bytes %i-%i/%i" % (start, end, member.size)
+
+            length = end - start + 1 if member else 0
+            # a 304 has no body, and its Content-Length would be the member's
+            if not status.startswith("304"):
+                response["Content-Length"] = str(length)
+            response["Connection"] = "keep-alive" if keep_alive else "close"
+            writer.write(("HTTP/1.1 %s\r\n" % status).encode("latin-1"))
+            writer.write("".join("%s: %s\r\n" % item for item in response.items()).encode("latin-1"))
+            writer.write(b"\r\n")
+
+            if member and length and method == "GET":
+                await writer.drain()
+                # each request gets its own file, as sendfile() may seek it
+                with open(archives[archive].archives[0], "rb") as f:
+                    await loop.sendfile(writer.transport, f, member.offset + 24 + start, length)
+            await writer.drain()
+            if not keep_alive:
+                break
+    except ConnectionError:
+        pass
+    finally:
+        writer.close()
+
+async def start_server(*archives, host="127.0.0.1", port=8080):
+    """Start serving the archives' members over HTTP on the running loop.
+
+    Members are served at '/<archive file name>/<resolved path>', with
+    support for Range requests and ETags. Data is sent with sendfile()
+    where the platform allows it. Returns the asyncio server."""
+    sets = {os.path.basename(archive): LGPSet(archive) for archive in archives}
+    return await asyncio.start_server(lambda r, w: _http_client(sets, r, w), host, port)
+
+def serve(*archives, host="127.0.0.1", port=8080):
+    """Serve the archives' members over HTTP until interrupted."""
+    async def run():
+        server = await start_server(*archives, host=host, port=port)
+        async with server:
+            await server.serve_forever()
+    asyncio.run(run())
+
+def rebuild_index(file):
+    """Fix the lookup table of an archive in place.
+
+    The ToC entries are reordered by lookup bucket, and the lookup table
+    and the ToC indices in the conflicts table are recomputed. Data never
+    moves, since the ToC points to it by offset, so only the header
+    region is rewritten. Returns False if it was already correct."""
+    with open(file, "r+b") as f:
+        with _map(file) as data:
+            header = _parse_header(data)
+            raw = data[:header.size]
+        num = len(header.toc)
+        buckets = [_lookup_index(entry.name) for entry in header.toc]
+        for entry, bucket in zip(header.toc, buckets):
+            if not 0 <= bucket < _LOOKUP_TABLE_ENTRIES:
+                raise ValueError("Invalid filename: %s" % entry.name)
+        # sorting is stable, entries of a bucket stay in the same order
+        order = sorted(range(num), key=lambda i: buckets[i])
+        position = [None] * num
+        for new, old in enumerate(order):
+            position[old] = new
+
+        region = bytearray()
+        for old in order:
+            region += raw[16+old*27:16+old*27+27]
+        lookup = [[0, 0] for i in range(_LOOKUP_TABLE_ENTRIES)]
+        for new, old in enumerate(order):
+            if not lookup[buckets[old]][1]:
+                lookup[buckets[old]][0] = new + 1
+            lookup[buckets[old]][1] += 1
+        for toc_offset, count in lookup:
+            region += toc_offset.to_bytes(2, "little") + count.to_bytes(2, "little")
+        region += len(header.conflicts).to_bytes(2, "little")
+        pointer = 16 + num * 27 + _LOOKUP_TABLE_ENTRIES * 4 + 2
+        for entries in header.conflicts:
+            region += len(entries).to_bytes(2, "little")
+            pointer += 2
+            for subdir, index in entries:
+                # keep the name bytes as they were, only the index changes
+                region += raw[pointer:pointer+128]
+                region += (position[index] if index < num else index).to_bytes(2, "little")
+                pointer += 130
+
+        if region == raw[16:]:
+            return False
+        f.seek(16)
+        f.write(region)
+    return True
+
+def _print_verify(file, manifest=None):
+    errors = verify(file, manifest)
+    for error in errors:
+        print("Error: %s" % error)
+    if not errors:
+        print("'%s' is valid." % file)
+
+def _print_diff(old, new):
+    changes = diff(old, new)
+    for kind, sign in (("added", "+"), ("removed", "-"), ("changed", "*")):
+        for path in changes[kind]:
+            print(sign, path)
+    print("%i added, %i removed, %i changed, %i unchanged" % tuple(
+          len(changes[kind]) for kind in ("added", "removed", "changed", "unchanged")))
+
+def _convert(file, output):
+    # the direction and format are told by the file names, or the contents
+    if zipfile.is_zipfile(file):
+        from_zip(file, output)
+    elif tarfile.is_tarfile(file):
+        from_tar(file, output)
+    elif output.lower().endswith(".zip"):
+        to_zip(file, output)
+    else:
+        name = output.lower()
+        compression = ""
+        for ext, kind in ((".gz", "gz"), (".tgz", "gz"), (".bz2", "bz2"), (".xz", "xz")):
+            if name.endswith(ext):
+                compression = kind
+        to_tar(file, output, compression)
 
 def print_help():
     print("Python 3 library for Final Fantasy VII's LGP files.", "",
           "  Author: " + __author__, "  Version: " + __version__, "",
           "Available command line parameters:",
           "--extract    Extract an archive into a folder",
-          "Usage: %s --extract <file> [directory]" % _libname_, "",
+          "Usage: %s --extract <file> [directory]" % _libname_,
+          "Usage: %s --extract - <directory>  (reads the archive from stdin)" % _libname_,
+          "Usage: %s --extract <file> <directory> <pattern>  (only matching members)" % _libname_, "",
           # not implemented yet
           # "--repack     Repack a folder into an archive",
           # "Usage: %s --repack <directory> [file]" % _libname_, "",
           # "--insert     Insert a folder into an archive"
           # "Usage: %s --insert <directory> [file]" % _libname_, "",
+          "--verify     Check an archive for errors, optionally against a manifest",
+          "Usage: %s --verify <file> [manifest]" % _libname_, "",
+          "--manifest   Write the checksums of an archive's members",
+          "Usage: %s --manifest <file> [manifest]" % _libname_, "",
+          "--diff       List the members that differ between two archives",
+          "Usage: %s --diff <old> <new>" % _libname_, "",
+          "--patch      Write a patch turning an archive into a newer one",
+          "Usage: %s --patch <old> <new> <patch>" % _libname_, "",
+          "--apply      Apply a patch to an archive",
+          "Usage: %s --apply <file> <patch>" % _libname_, "",
+          "--mount      Browse an archive as a read-only filesystem (needs fusepy)",
+          "Usage: %s --mount <file> <directory>" % _libname_, "",
+          "--serve      Serve an archive's members over HTTP on localhost",
+          "Usage: %s --serve <file> [port]" % _libname_, "",
+          "--pack       Pack the files listed in a manifest into an archive",
+          "Usage: %s --pack <manifest|directory> <file> [base]" % _libname_, "",
+          "--search     List the members containing a string, and where",
+          "Usage: %s --search <file> <string>" % _libname_, "",
+          "--merge      Merge several archives into a new one, the last ones winning",
+          "Usage: %s --merge <output> <file> <file>..." % _libname_, "",
+          "--convert    Convert an archive to or from tar or zip, by file extension",
+          "Usage: %s --convert <file> <output>" % _libname_, "",
+          "--rebuild-index  Fix the lookup table of an archive in place",
+          "Usage: %s --rebuild-index <file>" % _libname_, "",
           "--help       Display this help message",
           "Usage: %s --help" % _libname_, sep="\n")
 
-if len(sys.argv) == 2:
-    if os.path.isfile(sys.argv[1]):
-        extract(sys.argv[1])
-    # elif os.path.isdir(sys.argv[1]):
-    #     repack(sys.argv[1])
-
-if len(sys.argv) == 3:
-    param, file = sys.argv[1:]
-    if param in ("-e", "--extract"):
-        if os.path.isfile(file):
-            extract(file)
-        else:
-            print("Error: '%s' is not a file." % file)
-
-    # if param in ("-r", "--repack"):
-    #     if os.path.isdir(file):
-    #         repack(file)
-    #     else:
-    #         print("Error: '%s' is not a directory." % file)
-
-    # if param in ("-i", "--insert"):
-    #    if os.path.isdir(file):
-    #         insert(file)
-    #     else:
-    #         print("Error: '%s' is not a directory." % file)
-
-    if param in ("-h", "--help"):
-        print_help()
-
-if len(sys.argv) == 4:
-    param, file, folder = sys.argv[1:]
-    if param in ("-e", "--extract"):
-        if os.path.isfile(file):
-            extract(file, folder)
-        else:
-            print("Error: '%s' is not a file." % file)
+def main(argv):
+    """Run the command line given in 'argv', as described by print_help()."""
+    if len(argv) == 2:
+        if os.path.isfile(argv[1]):
+            extract(argv[1])
+        # elif os.path.isdir(argv[1]):
+        #     repack(argv[1])
+
+    if len(argv) == 3:
+        param, file = argv[1:]
+        if param in ("-e", "--extract"):
+            if os.path.isfile(file):
+                extract(file)
+            else:
+                print("Error: '%s' is not a file." % file)
+
+        # if param in ("-r", "--repack"):
+        #     if os.path.isdir(file):
+        #         repack(file)
+        #     else:
+        #         print("Error: '%s' is not a directory." % file)
+
+        # if param in ("-i", "--insert"):
+        #    if os.path.isdir(file):
+        #         insert(file)
+        #     else:
+        #         print("Error: '%s' is not a directory." % file)
+
+        if param in ("-v", "--verify"):
+            if os.path.isfile(file):
+                _print_verify(file)
+            else:
+                print("Error: '%s' is not a file." % file)
+
+        if param in ("-m", "--manifest"):
+            if os.path.isfile(file):
+                manifest(file, file + ".manifest")
+            else:
+                print("Error: '%s' is not a file." % file)
+
+        if param in ("--rebuild-index",):
+            if os.path.isfile(file):
+                if not rebuild_index(file):
+                    print("'%s' was already correct." % file)
+            else:
+                print("Error: '%s' is not a file." % file)
+
+        if param in ("-s", "--serve"):
+            if os.path.isfile(file):
+                serve(file)
+            else:
+                print("Error: '%s' is not a file." % file)
+
+        if param in ("-h", "--help"):
+            print_help()
+
+    if len(argv) == 4:
+        param, file, folder = argv[1:]
+        if param in ("-e", "--extract"):
+            if os.path.isfile(file):
+                extract(file, folder)
+            elif file == "-":
+                extract_stream(sys.stdin.buffer, folder)
+            else:
+                print("Error: '%s' is not a file." % file)
+
+        if param in ("-v", "--verify"):
+            if os.path.isfile(file):
+                _print_verify(file, folder)
+            else:
+                print("Error: '%s' is not a file." % file)
 
-    # if param in ("-r", "--repack"):
-    #     if os.path.isdir(file):
-    #         repack(file, folder) # it's actually the other way around
-    #     else:
-    #         print("Error: '%s' is not a directory." % file)
+        if param in ("-m", "--manifest"):
+            if os.path.isfile(file):
+                manifest(file, folder)
+            else:
+                print("Error: '%s' is not a file." % file)
 
-    # if param in ("-i", "--insert"):
-    #     if os.path.isdir(file):
-    #         insert(file, folder):
-    #     else:
-    #         print("Error: '%s' is not a directory." % file)
+        if param in ("-d", "--diff"):
+            if os.path.isfile(file) and os.path.isfile(folder):
+                _print_diff(file, folder)
+            else:
+                print("Error: '%s' and '%s' must be files." % (file, folder))
 
+        if param in ("--pack",):
+            if os.path.exists(file):
+                pack(file, folder, file.rstrip("/\\") + ".cache")
+            else:
+                print("Error: '%s' does not exist." % file)
+
+        if param in ("-f", "--search"):
+            if os.path.isfile(file):
+                for path, offset, pattern in search(file, folder):
+                    print("%s: 0x%x" % (path, offset))
+            else:
+                print("Error: '%s' is not a file." % file)
+
+        if param in ("-c", "--convert"):
+            if os.path.isfile(file):
+                _convert(file, folder)
+            else:
+                print("Error: '%s' is not a file." % file)
+
+        if param in ("-s", "--serve"):
+            if os.path.isfile(file) and folder.isdigit():
+                serve(file, port=int(folder))
+            else:
+                print("Error: '%s' must be a file and '%s' a port." % (file, folder))
+
+        if param in ("--mount",):
+            if os.path.isfile(file) and os.path.isdir(folder):
+                mount(folder, file)
+            else:
+                print("Error: '%s' must be a file and '%s' a directory." % (file, folder))
+
+        if param in ("-a", "--apply"):
+            if os.path.isfile(file) and os.path.isfile(folder):
+                apply(file, folder)
+            else:
+                print("Error: '%s' and '%s' must be files." % (file, folder))
+
+    if len(argv) == 5:
+        param, old, new, patch = argv[1:]
+        if param in ("-e", "--extract"):
+            # here the arguments are the archive, the folder and the pattern
+            if os.path.isfile(old):
+                extract(old, new, include=patch)
+            else:
+                print("Error: '%s' is not a file." % old)
+
+        if param in ("--pack",):
+            # here the arguments are the manifest, the archive and its base
+            if os.path.exists(old) and os.path.isfile(patch):
+                pack(old, new, old.rstrip("/\\") + ".cache", base=patch)
+            else:
+                print("Error: '%s' and '%s' must exist." % (old, patch))
+
+        if param in ("-p", "--patch"):
+            if os.path.isfile(old) and os.path.isfile(new):
+                make_patch(old, new, patch)
+            else:
+                print("Error: '%s' and '%s' must be files." % (old, new))
+
+        # if param in ("-r", "--repack"):
+        #     if os.path.isdir(file):
+        #         repack(file, folder) # it's actually the other way around
+        #     else:
+        #         print("Error: '%s' is not a directory." % file)
+
+        # if param in ("-i", "--insert"):
+        #     if os.path.isdir(file):
+        #         insert(file, folder):
+        #     else:
+        #         print("Error: '%s' is not a directory." % file)
+
+    if len(argv) > 3 and argv[1] == "--merge":
+        missing = [file for file in argv[3:] if not os.path.isfile(file)]
+        if missing:
+            print("Error: '%s' is not a file." % missing[0])
+        else:
+            merge(argv[2], *argv[3:])
 
 if __name__ == "__main__":
+    main(sys.argv)
     print_help()
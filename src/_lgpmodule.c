@@ -1,3 +1,4 @@
+#define PY_SSIZE_T_CLEAN
 #include "Python.h"
 #include "structmember.h"
 #include "_lgpmodule.h"
@@ -42,20 +43,108 @@ void *malloc_read(FILE *f, int size)
 struct file_list
 {
     struct file_header file_header;
-    char source_name[256];
+    char *source_name;
     int toc_index;
     int conflict;
+    int part;
     struct file_list *next;
 };
 
-struct conflict_entry conflicts[MAX_CONFLICTS][255];
+struct conflict_entry conflicts[MAX_CONFLICTS][MAX_CONFLICT_ENTRIES];
 unsigned short num_conflict_entries[MAX_CONFLICTS];
 
 struct lookup_table_entry lookup_table[LOOKUP_TABLE_ENTRIES];
 struct file_list *lookup_list[LOOKUP_TABLE_ENTRIES];
 
+/* the sorted runs a split pack spilled, with the next file of each */
+struct spill_record
+{
+    struct file_header file_header;
+    int lookup_index;
+    unsigned int source_length;
+};
+
+FILE *spill_runs[MAX_SPILL_RUNS];
+struct file_list *spill_heads[MAX_SPILL_RUNS];
+int spill_indices[MAX_SPILL_RUNS];
+int num_spill_runs = 0;
+
 int files_read = 0;
+int files_listed = 0;
 int files_total = 0;
+int split_output = 0;
+
+int compare_files(struct file_list *a, struct file_list *b)
+{
+    /* names differing only by case are the same to FF7, keep them together */
+    int res = strcasecmp(a->file_header.name, b->file_header.name);
+
+    if(!res) res = strcmp(a->file_header.name, b->file_header.name);
+
+    if(res) return res;
+
+    return strcmp(a->source_name, b->source_name);
+}
+
+void reset_conflicts(void)
+{
+    int i;
+
+    /* only clear what was used, the whole table is over 100 MB */
+    for(i = 0; i < MAX_CONFLICTS && num_conflict_entries[i]; i++)
+    {
+        memset(conflicts[i], 0, sizeof(**conflicts) * num_conflict_entries[i]);
+        num_conflict_entries[i] = 0;
+    }
+}
+
+void free_files(struct file_list *file)
+{
+    while(file)
+    {
+        struct file_list *next = file->next;
+        free(file->source_name);
+        free(file);
+        file = next;
+    }
+}
+
+void free_file_list(void)
+{
+    int i;
+
+    for(i = 0; i < LOOKUP_TABLE_ENTRIES; i++)
+    {
+        free_files(lookup_list[i]);
+        lookup_list[i] = 0;
+    }
+
+    files_listed = 0;
+}
+
+void reset_file_list(void)
+{
+    int i;
+
+    free_file_list();
+
+    for(i = 0; i < num_spill_runs; i++)
+    {
+        fclose(spill_runs[i]);
+        free_files(spill_heads[i]);
+        spill_heads[i] = 0;
+    }
+
+    num_spill_runs = 0;
+
+    reset_conflicts();
+    memset(lookup_table, 0, sizeof(lookup_table));
+
+    files_read = 0;
+    files_total = 0;
+}
+
+int spill_file_list(void);
 
 int read_directory(char *base_path, char *path, DIR *d)
 {
@@ -64,11 +153,8 @@ int read_directory(char *base_path, char *path, DIR *d)
 
     while((dent = readdir(d)))
     {
-        int lookup_value1;
-        int lookup_value2;
         int lookup_index;
         struct file_list *file;
-        struct file_list *last;
         struct stat s;
 
         if(!strcmp(dent->d_name, ".") || !strcmp(dent->d_name, "..")) continue;
@@ -107,312 +193,1648 @@ int read_directory(char *base_path, char *path, DIR *d)
             if(strcmp(path, "")) sprintf(new_path, "%s/%s", path, dent->d_name);
             else strcpy(new_path, dent->d_name);
 
-            read_directory(base_path, new_path, new_d);
+            if (read_directory(base_path, new_path, new_d) < 0)
+            {
+                closedir(new_d);
+                return -1;
+            }
 
             closedir(new_d);
 
             continue;
         }
 
-        lookup_value1 = lgp_lookup_value(dent->d_name[0]);
-        lookup_value2 = lgp_lookup_value(dent->d_name[1]);
+        lookup_index = lgp_lookup_index(dent->d_name);
 
-        if(lookup_value1 > LOOKUP_VALUE_MAX || lookup_value1 < 0 || lookup_value2 > LOOKUP_VALUE_MAX || lookup_value2 < -1)
+        if(lookup_index < 0)
         {
             PyErr_Format(PyExc_ValueError, "Invalid filename: %s", dent->d_name);
             return -1;
         }
 
-        lookup_index = lookup_value1 * LOOKUP_VALUE_MAX + lookup_value2 + 1;
-
-        lookup_table[lookup_index].num_files++;
+        /* stop right away rather than keep scanning a tree that can't fit */
+        if(files_read == MAX_FILES && !split_output)
+        {
+            PyErr_Format(PyExc_OverflowError, "Too many input files, an archive can hold at most %i", MAX_FILES);
+            return -1;
+        }
 
-        last = lookup_list[lookup_index];
+        /* keep at most an archive's worth of files in memory */
+        if(files_listed == MAX_FILES && spill_file_list() < 0) return -1;
 
-        if(last) while(last->next) last = last->next;
+        if((unsigned long long)s.st_size > MAX_ARCHIVE_SIZE)
+        {
+            PyErr_Format(PyExc_OverflowError, "Input file too large: %s", tmp);
+            return -1;
+        }
 
         file = calloc(sizeof(*file), 1);
         strcpy(file->file_header.name, dent->d_name);
+        file->source_name = malloc(strlen(path) + strlen(dent->d_name) + 2);
         sprintf(file->source_name, "%s/%s", path, dent->d_name);
         file->file_header.size = s.st_size;
-        file->next = 0;
 
-        if(last) last->next = file;
-        else lookup_list[lookup_index] = file;
+        /* buckets are sorted once the whole tree is read, see sort_file_list() */
+        file->next = lookup_list[lookup_index];
+        lookup_list[lookup_index] = file;
 
         files_read++;
+        files_listed++;
     }
     return 0;
 }
 
-static PyObject *
-lgp_pack(PyObject *self, PyObject *args)
+/* Merge sort of a bucket, so inserting every file in order isn't quadratic */
+struct file_list *sort_bucket(struct file_list *list)
 {
-    DIR *d;
-    FILE *f;
-    int toc_size;
-    int toc_index = 0;
-    int offset = 0;
-    int i;
-    char tmp[512];
-    int conflict_table_size = 2;
-    unsigned short num_conflicts = 0;
-    char *directory;
-    char *archive;
+    struct file_list *half = list;
+    struct file_list *end = list;
+    struct file_list *merged = 0;
+    struct file_list **last = &merged;
 
-    if (!PyArg_ParseTuple(args, "ss:pack", &directory, &archive))
-        return NULL;
-
-    d = opendir(directory);
+    if(!list || !list->next) return list;
 
-    if (!d) {
-        PyErr_SetString(PyExc_OSError, "Error opening input directory");
-        return NULL;
+    while(end->next && end->next->next)
+    {
+        half = half->next;
+        end = end->next->next;
     }
 
-    memset(lookup_table, 0, sizeof(lookup_table));
+    end = half->next;
+    half->next = 0;
+    list = sort_bucket(list);
+    end = sort_bucket(end);
 
-    if (read_directory(directory, "", d) < 0)
+    while(list && end)
     {
-        closedir(d);
-        return NULL;
+        struct file_list **first = compare_files(end, list) < 0 ? &end : &list;
+
+        *last = *first;
+        last = &(*first)->next;
+        *first = (*first)->next;
     }
 
-    closedir(d);
+    *last = list ? list : end;
 
-    if (!files_read)
-    {
-        PyErr_SetString(PyExc_ValueError, "No input files found.");
-        return NULL;
-    }
+    return merged;
+}
+
+/* Sort each bucket, so the output doesn't depend on readdir order */
+void sort_file_list(void)
+{
+    int i;
+
+    for(i = 0; i < LOOKUP_TABLE_ENTRIES; i++)
+        lookup_list[i] = sort_bucket(lookup_list[i]);
+}
+
+/* Move the file list, sorted, to a new temporary file; a split pack merges
+ * these runs back in next_spilled_file(), so however many files there are
+ * only an archive's worth is ever in memory */
+int spill_file_list(void)
+{
+    FILE *f;
+    int i;
 
-    if (!unlink(archive))
+    if(num_spill_runs == MAX_SPILL_RUNS)
     {
-        PyErr_Format(PyExc_OSError, "Could not unlink %s", archive);
-        return NULL;
+        PyErr_Format(PyExc_OverflowError, "Too many input files, a split pack can hold at most %i", MAX_SPLIT_FILES);
+        return -1;
     }
-    f = fopen(archive, "wb");
+
+    f = tmpfile();
 
     if(!f)
     {
-        PyErr_Format(PyExc_OSError, "Error opening output file %s", archive);
-        return NULL;
+        PyErr_SetString(PyExc_OSError, "Could not create a temporary file");
+        return -1;
     }
 
-    /* printf("Number of files to add: %i\n", files_read); */
+    spill_runs[num_spill_runs++] = f;
 
-    if (fwrite("\0\0SQUARESOFT", 12, 1, f) < 0)
-    {
-        PyErr_SetString(PyExc_OSError, "Could not write to file");
-        return NULL;
-    }
-    if (fwrite(&files_read, 4, 1, f) < 0)
-    {
-        PyErr_SetString(PyExc_OSError, "Could not write to file");
-        return NULL;
-    }
+    sort_file_list();
 
     for(i = 0; i < LOOKUP_TABLE_ENTRIES; i++)
     {
-        struct file_list *file = lookup_list[i];
-
-        while(file)
+        while(lookup_list[i])
         {
-            file->toc_index = toc_index++;
-            file = file->next;
+            struct file_list *file = lookup_list[i];
+            struct spill_record record;
+
+            memset(&record, 0, sizeof(record));
+            record.file_header = file->file_header;
+            record.lookup_index = i;
+            record.source_length = strlen(file->source_name);
+
+            if(fwrite(&record, sizeof(record), 1, f) != 1 || fwrite(file->source_name, 1, record.source_length, f) != record.source_length)
+            {
+                PyErr_SetString(PyExc_OSError, "Could not write to a temporary file");
+                return -1;
+            }
+
+            lookup_list[i] = file->next;
+            file->next = 0;
+            free_files(file);
         }
     }
 
-    for(i = 0; i < LOOKUP_TABLE_ENTRIES; i++)
+    files_listed = 0;
+
+    if(fflush(f) || fseek(f, 0, SEEK_SET))
     {
-        struct file_list *file = lookup_list[i];
+        PyErr_SetString(PyExc_OSError, "Could not write to a temporary file");
+        return -1;
+    }
 
-        while(file)
-        {
-            if(!file->conflict)
-            {
-                struct file_list *file2 = lookup_list[i];
+    return 0;
+}
 
-                /* debug_printf("Finding conflict for file %s\n", file->file_header.name); */
+/* Read back the next file of a run, or NULL at its end (or on error, then
+ * with an exception set) */
+struct file_list *read_spill_record(FILE *f, int *lookup_index)
+{
+    struct spill_record record;
+    struct file_list *file;
 
-                while(file2)
-                {
-                    if(!strcmp(file->file_header.name, file2->file_header.name) && file != file2)
-                    {
-                        if(num_conflict_entries[num_conflicts] == 0)
-                        {
-                            /* debug_printf("New conflict %i (%s)\n", num_conflicts + 1, file->file_header.name); */
+    if(fread(&record, sizeof(record), 1, f) != 1)
+    {
+        if(ferror(f)) PyErr_SetString(PyExc_OSError, "Could not read from a temporary file");
+        return NULL;
+    }
 
-                            file->conflict = num_conflicts + 1;
-                            strncpy(conflicts[num_conflicts][0].name, file->source_name, strlen(file->source_name) - strlen(file->file_header.name) - 1);
-                            conflicts[num_conflicts][0].toc_index = file->toc_index;
-                            num_conflict_entries[num_conflicts]++;
+    file = calloc(sizeof(*file), 1);
+    if(file) file->source_name = malloc(record.source_length + 1);
 
-                            conflict_table_size += 130;
-                        }
+    if(!file || !file->source_name)
+    {
+        free(file);
+        PyErr_NoMemory();
+        return NULL;
+    }
 
-                        file2->conflict = num_conflicts + 1;
-                        strncpy(conflicts[num_conflicts][num_conflict_entries[num_conflicts]].name, file2->source_name, strlen(file2->source_name) - strlen(file2->file_header.name) - 1);
-                        conflicts[num_conflicts][num_conflict_entries[num_conflicts]].toc_index = file2->toc_index;
-                        num_conflict_entries[num_conflicts]++;
+    if(fread(file->source_name, 1, record.source_length, f) != record.source_length)
+    {
+        free_files(file);
+        PyErr_SetString(PyExc_OSError, "Could not read from a temporary file");
+        return NULL;
+    }
 
-                        conflict_table_size += 130;
-                    }
+    file->source_name[record.source_length] = 0;
+    file->file_header = record.file_header;
+    *lookup_index = record.lookup_index;
 
-                    file2 = file2->next;
-                }
+    return file;
+}
 
-                if(num_conflict_entries[num_conflicts] != 0)
-                {
-                    num_conflicts++;
-                    conflict_table_size += 2;
-                }
-            }
-            /* else debug_printf("Not finding conflict for file %s (%i)\n", file->file_header.name, file->conflict); */
+/* Take the next file of the spilled runs, in the order sort_file_list() would
+ * give if they were all in memory, or NULL once they are all taken (or on
+ * error, then with an exception set) */
+struct file_list *next_spilled_file(int *lookup_index)
+{
+    struct file_list *file;
+    int best = -1;
+    int i;
 
-            file = file->next;
+    for(i = 0; i < num_spill_runs; i++)
+    {
+        if(!spill_heads[i] && !feof(spill_runs[i]))
+        {
+            spill_heads[i] = read_spill_record(spill_runs[i], &spill_indices[i]);
+            if(!spill_heads[i] && PyErr_Occurred()) return NULL;
         }
+
+        if(spill_heads[i] && (best < 0 || spill_indices[i] < spill_indices[best] ||
+            (spill_indices[i] == spill_indices[best] && compare_files(spill_heads[i], spill_heads[best]) < 0)))
+            best = i;
     }
 
-    /* if(num_conflicts) debug_printf("%i conflicts\n", num_conflicts); */
+    if(best < 0) return NULL;
 
-    toc_size = files_read * sizeof(struct toc_entry);
+    file = spill_heads[best];
+    *lookup_index = spill_indices[best];
+    spill_heads[best] = 0;
 
-    for(i = 0; i < LOOKUP_TABLE_ENTRIES; i++)
+    return file;
+}
+
+/* Fill the file list with the next part of a split pack: as many of the
+ * spilled files as the format limits allow, counting the size of the header
+ * as if every file was part of a conflict. Files with the same name are kept
+ * in one part when they fit, the files taken that belong to the next part
+ * are left in 'pending'. Returns the number of files, 0 once all are taken. */
+int load_part(int part, struct file_list **pending, int *pending_index)
+{
+    struct file_list **tails[LOOKUP_TABLE_ENTRIES];
+    struct file_list **run = NULL;
+    struct file_list *last = NULL;
+    int last_index = -1;
+    int run_length = 0;
+    int conflicts = 0;
+    unsigned long long size = 0;
+    int i;
+
+    for(i = 0; i < LOOKUP_TABLE_ENTRIES; i++) tails[i] = &lookup_list[i];
+
+    files_listed = 0;
+
+    for(;;)
     {
-        struct file_list *file = lookup_list[i];
-        struct toc_entry toc;
+        struct file_list *file = *pending;
+        int lookup_index = *pending_index;
+        unsigned long long file_size;
+        int same;
 
-        if(file) lookup_table[i].toc_offset = file->toc_index + 1;
+        if(file) *pending = file->next;
+        else if(!(file = next_spilled_file(&lookup_index))) return PyErr_Occurred() ? -1 : files_listed;
 
-        while(file)
+        file->next = 0;
+        file_size = FILE_HEADER_SIZE + file->file_header.size;
+        same = last && lookup_index == last_index && !strcasecmp(last->file_header.name, file->file_header.name);
+
+        if(files_listed == MAX_FILES || (files_listed && HEADER_SIZE_MAX(files_listed + 1) + size + file_size > MAX_ARCHIVE_SIZE) ||
+            (same && run_length == 1 && conflicts == MAX_CONFLICTS) || (same && run_length == MAX_CONFLICT_ENTRIES))
         {
-            memcpy(toc.name, file->file_header.name, 20);
-            toc.offset = 16 + files_read * sizeof(struct toc_entry) + LOOKUP_TABLE_ENTRIES * 4 + conflict_table_size + offset;
-            toc.unknown = 14;
-            toc.conflict = file->conflict;
+            file->next = *pending;
+            *pending = file;
+            *pending_index = lookup_index;
 
-            if (fwrite(&toc, sizeof(struct toc_entry), 1, f) < 0)
+            /* move the files with that name along, unless they are the whole part */
+            if(same && run_length < files_listed && run_length < MAX_CONFLICT_ENTRIES)
             {
-                PyErr_SetString(PyExc_OSError, "Could not write to file");
-                return NULL;
+                last->next = file;
+                *pending = *run;
+                *run = 0;
+                files_listed -= run_length;
             }
 
-            offset += sizeof(file->file_header) + file->file_header.size;
+            return files_listed;
+        }
 
-            file = file->next;
+        if(!same)
+        {
+            run = tails[lookup_index];
+            run_length = 0;
         }
-    }
 
-    if (fwrite(lookup_table, sizeof(lookup_table), 1, f) < 0)
-    {
-        PyErr_SetString(PyExc_OSError, "Could not write to file");
-        return NULL;
-    }
+        if(++run_length == 2) conflicts++;
 
-    if (fwrite(&num_conflicts, 2, 1, f) < 0)
-    {
-        PyErr_SetString(PyExc_OSError, "Could not write to file");
-        return NULL;
-    }
+        file->part = part;
+        *tails[lookup_index] = file;
+        tails[lookup_index] = &file->next;
+        last = file;
+        last_index = lookup_index;
 
-    for(i = 0; i < MAX_CONFLICTS; i++)
-    {
-        if(num_conflict_entries[i] > 0)
-        {
-            if (fwrite(&num_conflict_entries[i], 2, 1, f) < 0)
-            {
-                PyErr_SetString(PyExc_OSError, "Could not write to file");
-                return NULL;
-            }
-            if (fwrite(conflicts[i], sizeof(**conflicts), num_conflict_entries[i], f) < 0)
-            {
-                PyErr_SetString(PyExc_OSError, "Could not write to file");
-                return NULL;
-            }
-        }
+        files_listed++;
+        size += file_size;
     }
+}
 
-    for(i = 0; i < LOOKUP_TABLE_ENTRIES; i++)
-    {
-        struct file_list *file = lookup_list[i];
+void part_name(char *dest, char *archive, int part)
+{
+    char *ext = strrchr(archive, '.');
 
-        while(file)
-        {
-            FILE *inf;
-            char *data;
+    if(!part || !ext || strchr(ext, '/') || strchr(ext, '\\')) ext = archive + strlen(archive);
 
-            sprintf(tmp, "%s/%s", directory, file->source_name);
-            inf = fopen(tmp, "rb");
+    if(!part) strcpy(dest, archive);
+    else sprintf(dest, "%.*s_%i%s", (int)(ext - archive), archive, part, ext);
+}
 
-            if (!inf)
-            {
-                PyErr_Format(PyExc_OSError, "Error opening input file: %s", file->source_name);
-                unlink(archive);
-                return NULL;
-            }
+/* The 24 bytes preceding the data of each file in the archive */
+void encode_file_header(unsigned char *dest, struct file_header *file_header)
+{
+    memcpy(dest, file_header->name, 20);
+    lgp_put_u32(dest + 20, file_header->size);
+}
 
-            data = malloc_read(inf, file->file_header.size);
+/* The subdirectory telling a file apart from others with the same name,
+ * without the leading slash; the destination must be zeroed beforehand */
+void conflict_name(char *dest, struct file_list *file)
+{
+    const char *source = file->source_name + (file->source_name[0] == '/');
+    size_t length = strlen(source) - strlen(file->file_header.name);
 
-            if (fwrite(&file->file_header, sizeof(file->file_header), 1, f) < 0)
-            {
-                PyErr_SetString(PyExc_OSError, "Could not write to file");
-                return NULL;
-            }
+    /* files at the root have no separator to remove */
+    if (length) length--;
 
-            if (fwrite(data, file->file_header.size, 1, f) < 0)
-            {
-                PyErr_SetString(PyExc_OSError, "Could not write to file");
-                return NULL;
-            }
+    memcpy(dest, source, length);
+}
 
-            if (fclose(inf) < 0)
-            {
-                PyErr_SetString(PyExc_OSError, "Could not close file");
-                return NULL;
-            }
+/* Where the archive is written to: a stdio file, or a Python file-like object */
+struct lgp_output
+{
+    FILE *f;
+    PyObject *stream;
+    int workers;        /* threads copying the input files, if more than 1 */
+};
 
-            free(data);
+int output_write(struct lgp_output *out, const void *data, size_t size)
+{
+    size_t res;
 
-            file = file->next;
+    /* raw streams may write less than asked, the rest is written again;
+     * a write() returning None is taken to have written everything */
+    while(out->stream && size)
+    {
+        PyObject *written = PyObject_CallMethod(out->stream, "write", "y#", data, (Py_ssize_t)size);
+        Py_ssize_t count = size;
+
+        if(!written) return -1;
+
+        if(written != Py_None)
+            count = PyLong_AsSsize_t(written);
+
+        Py_DECREF(written);
+
+        if(count < 0 && PyErr_Occurred()) return -1;
+
+        if(count <= 0 || (size_t)count > size)
+        {
+            PyErr_SetString(PyExc_OSError, "Could not write to stream");
+            return -1;
         }
+
+        data = (const char *)data + count;
+        size -= count;
     }
 
-    if (fwrite("FINAL FANTASY7", 14, 1, f) < 0)
+    if(!size) return 0;
+
+    /* the other end of a pipe may need the GIL to read what's written */
+    Py_BEGIN_ALLOW_THREADS
+    res = fwrite(data, size, 1, out->f);
+    Py_END_ALLOW_THREADS
+
+    if(res != 1)
     {
         PyErr_SetString(PyExc_OSError, "Could not write to file");
-        return NULL;
+        return -1;
     }
 
-    if (fclose(f) < 0)
-    {
-        PyErr_SetString(PyExc_OSError, "Could not close file");
-        return NULL;
-    }
+    return 0;
+}
 
-    /* printf("Successfully created archive with %i file(s) out of %i file(s) total.\n", files_read, files_total); */
+/* Open an input file, and tell the OS we'll soon read all of it */
+FILE *open_input(char *directory, struct file_list *file)
+{
+    char tmp[1024];
+    FILE *inf;
 
-    Py_RETURN_NONE;
-}
+    snprintf(tmp, sizeof(tmp), "%s/%s", directory, file->source_name);
 
-PyDoc_STRVAR(pack_doc, "Repack a folder into a single LGP archive.");
+    Py_BEGIN_ALLOW_THREADS
+    inf = fopen(tmp, "rb");
 
-/* unlgp.c part */
+#ifdef POSIX_FADV_WILLNEED
+    if(inf) posix_fadvise(fileno(inf), 0, 0, POSIX_FADV_WILLNEED);
+#endif
+    Py_END_ALLOW_THREADS
 
-static PyObject *
-lgp_unpack(_LGPObject *self, PyObject *args)
+    return inf;
+}
+
+#ifdef LGP_THREADS
+/* Input files to copy to their precomputed offsets, shared by all threads */
+struct pack_job
 {
-    FILE *f;
-    char tmp[512];
+    char *directory;
+    struct file_list **files;
+    unsigned long long *offsets;
     int num_files;
-    int i;
-    int k;
+    int out;
+    int next;           /* next file to be picked by a thread */
+    int failed;         /* index of the file that couldn't be copied, or -1 */
+    pthread_mutex_t lock;
+};
+
+struct pack_worker
+{
+    struct pack_job *job;
+    char *buffer;
+    pthread_t thread;
+};
+
+int pwrite_all(int fd, const char *data, size_t size, unsigned long long offset)
+{
+    while (size)
+    {
+        Py_ssize_t res = pwrite(fd, data, size, offset);
+
+        if (res <= 0) return -1;
+
+        data += res;
+        size -= res;
+        offset += res;
+    }
+
+    return 0;
+}
+
+/* Copy one input file, header included, to its place in the archive */
+int pack_file(struct pack_job *job, int i, char *buffer)
+{
+    char tmp[1024];
+    struct file_list *file = job->files[i];
+    unsigned long long offset = job->offsets[i];
+    unsigned int left = file->file_header.size;
+    unsigned char file_header[FILE_HEADER_SIZE];
+    int in;
+
+    snprintf(tmp, sizeof(tmp), "%s/%s", job->directory, file->source_name);
+    in = open(tmp, O_RDONLY | O_BINARY);
+
+    if (in < 0) return -1;
+
+    encode_file_header(file_header, &file->file_header);
+
+    if (pwrite_all(job->out, (char *)file_header, FILE_HEADER_SIZE, offset) < 0)
+    {
+        close(in);
+        return -1;
+    }
+
+    offset += FILE_HEADER_SIZE;
+
+#ifdef __linux__
+    while (left)
+    {
+        loff_t off = offset;
+        Py_ssize_t res = copy_file_range(in, NULL, job->out, &off, left, 0);
+
+        /* not supported between those files, fall back to reading */
+        if (res <= 0) break;
+
+        offset += res;
+        left -= res;
+    }
+#endif
+
+    while (left)
+    {
+        Py_ssize_t res = read(in, buffer, left < COPY_BUFFER_SIZE ? left : COPY_BUFFER_SIZE);
+
+        if (res <= 0 || pwrite_all(job->out, buffer, res, offset) < 0)
+        {
+            close(in);
+            return -1;
+        }
+
+        offset += res;
+        left -= res;
+    }
+
+    return close(in);
+}
+
+void *pack_thread(void *arg)
+{
+    struct pack_worker *worker = arg;
+    struct pack_job *job = worker->job;
+
+    for (;;)
+    {
+        int i;
+
+        pthread_mutex_lock(&job->lock);
+        i = job->failed < 0 ? job->next++ : job->num_files;
+        pthread_mutex_unlock(&job->lock);
+
+        if (i >= job->num_files) break;
+
+        if (pack_file(job, i, worker->buffer) < 0)
+        {
+            pthread_mutex_lock(&job->lock);
+            if (job->failed < 0) job->failed = i;
+            pthread_mutex_unlock(&job->lock);
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+/* Copy the input files from several threads, each one straight to its
+ * offset in the archive; the header must already be written */
+int write_parallel(char *directory, struct lgp_output *out, struct file_list **files, int num_files)
+{
+    struct pack_job job;
+    struct pack_worker *workers;
+    char *buffers;
+    unsigned long long offset;
+    int num_workers = out->workers < num_files ? out->workers : num_files;
+    int started = 0;
+    int i;
+
+    if (fflush(out->f))
+    {
+        PyErr_SetString(PyExc_OSError, "Could not write to file");
+        return -1;
+    }
+
+    job.directory = directory;
+    job.files = files;
+    job.num_files = num_files;
+    job.out = fileno(out->f);
+    job.next = 0;
+    job.failed = -1;
+    job.offsets = malloc(sizeof(*job.offsets) * (num_files ? num_files : 1));
+    workers = malloc(sizeof(*workers) * (num_workers ? num_workers : 1));
+    buffers = malloc((size_t)COPY_BUFFER_SIZE * (num_workers ? num_workers : 1));
+
+    if (!job.offsets || !workers || !buffers)
+    {
+        free(job.offsets);
+        free(workers);
+        free(buffers);
+        PyErr_NoMemory();
+        return -1;
+    }
+
+    offset = lseek(job.out, 0, SEEK_CUR);
+
+    for (i = 0; i < num_files; i++)
+    {
+        job.offsets[i] = offset;
+        offset += FILE_HEADER_SIZE + files[i]->file_header.size;
+    }
+
+    pthread_mutex_init(&job.lock, NULL);
+
+    Py_BEGIN_ALLOW_THREADS
+#ifdef __linux__
+    /* reserve the whole archive at once, it's only a hint */
+    fallocate(job.out, 0, 0, offset + 14);
+#endif
+
+    for (i = 0; i < num_workers; i++)
+    {
+        workers[i].job = &job;
+        workers[i].buffer = buffers + (size_t)COPY_BUFFER_SIZE * i;
+
+        if (pthread_create(&workers[i].thread, NULL, pack_thread, &workers[i]))
+            break;
+
+        started++;
+    }
+
+    /* do the work here if no thread could be started */
+    if (!started)
+    {
+        workers[0].job = &job;
+        workers[0].buffer = buffers;
+        pack_thread(&workers[0]);
+    }
+
+    for (i = 0; i < started; i++)
+        pthread_join(workers[i].thread, NULL);
+    Py_END_ALLOW_THREADS
+
+    pthread_mutex_destroy(&job.lock);
+    free(job.offsets);
+    free(workers);
+    free(buffers);
+
+    if (job.failed >= 0)
+    {
+        PyErr_Format(PyExc_OSError, "Could not copy input file: %s", files[job.failed]->source_name);
+        return -1;
+    }
+
+    if (pwrite_all(job.out, "FINAL FANTASY7", 14, offset) < 0 ||
+        fseeko(out->f, offset + 14, SEEK_SET))
+    {
+        PyErr_SetString(PyExc_OSError, "Could not write to file");
+        return -1;
+    }
+
+    return 0;
+}
+#endif
+
+/* Write an archive strictly sequentially, so the output doesn't need to be seekable */
+int write_archive(char *directory, struct lgp_output *out, int part)
+{
+    int toc_index = 0;
+    unsigned long long offset = 0;
+    int i;
+    int conflict_table_size = 2;
+    unsigned short num_conflicts = 0;
+    struct file_list **files;
+    FILE *inf = NULL;
+    FILE *next_inf = NULL;
+    char *buffer = NULL;
+    unsigned char *header = NULL;
+    unsigned char *p;
+    unsigned long long header_size;
+
+    reset_conflicts();
+    memset(lookup_table, 0, sizeof(lookup_table));
+
+    files = malloc(sizeof(*files) * (files_listed ? files_listed : 1));
+
+    if(!files)
+    {
+        PyErr_NoMemory();
+        return -1;
+    }
+
+    for(i = 0; i < LOOKUP_TABLE_ENTRIES; i++)
+    {
+        struct file_list *file = lookup_list[i];
+
+        while(file)
+        {
+            file->conflict = 0;
+
+            if(file->part == part)
+            {
+                if(!lookup_table[i].num_files) lookup_table[i].toc_offset = toc_index + 1;
+                lookup_table[i].num_files++;
+                files[toc_index] = file;
+                file->toc_index = toc_index++;
+            }
+
+            file = file->next;
+        }
+    }
+
+    for(i = 0; i < LOOKUP_TABLE_ENTRIES; i++)
+    {
+        struct file_list *file = lookup_list[i];
+
+        while(file)
+        {
+            if(!file->conflict && file->part == part)
+            {
+                /* buckets are sorted, so the files with the same name follow it */
+                struct file_list *file2 = file->next;
+
+                /* debug_printf("Finding conflict for file %s\n", file->file_header.name); */
+
+                while(file2 && !strcasecmp(file->file_header.name, file2->file_header.name))
+                {
+                    if(file2->part == part)
+                    {
+                        if(num_conflicts == MAX_CONFLICTS)
+                        {
+                            PyErr_Format(PyExc_OverflowError, "Too many conflicts, an archive can hold at most %i", MAX_CONFLICTS);
+                            goto fail;
+                        }
+
+                        if(num_conflict_entries[num_conflicts] == MAX_CONFLICT_ENTRIES)
+                        {
+                            PyErr_Format(PyExc_OverflowError, "Too many files named %s", file->file_header.name);
+                            goto fail;
+                        }
+
+                        if(strlen(file2->source_name) - strlen(file2->file_header.name) > sizeof(conflicts[0][0].name))
+                        {
+                            PyErr_Format(PyExc_ValueError, "Path too long: %s", file2->source_name);
+                            goto fail;
+                        }
+
+                        if(num_conflict_entries[num_conflicts] == 0)
+                        {
+                            /* debug_printf("New conflict %i (%s)\n", num_conflicts + 1, file->file_header.name); */
+
+                            if(strlen(file->source_name) - strlen(file->file_header.name) > sizeof(conflicts[0][0].name))
+                            {
+                                PyErr_Format(PyExc_ValueError, "Path too long: %s", file->source_name);
+                                goto fail;
+                            }
+
+                            file->conflict = num_conflicts + 1;
+                            conflict_name(conflicts[num_conflicts][0].name, file);
+                            conflicts[num_conflicts][0].toc_index = file->toc_index;
+                            num_conflict_entries[num_conflicts]++;
+
+                            conflict_table_size += 130;
+                        }
+
+                        file2->conflict = num_conflicts + 1;
+                        conflict_name(conflicts[num_conflicts][num_conflict_entries[num_conflicts]].name, file2);
+                        conflicts[num_conflicts][num_conflict_entries[num_conflicts]].toc_index = file2->toc_index;
+                        num_conflict_entries[num_conflicts]++;
+
+                        conflict_table_size += 130;
+                    }
+
+                    file2 = file2->next;
+                }
+
+                if(num_conflict_entries[num_conflicts] != 0)
+                {
+                    num_conflicts++;
+                    conflict_table_size += 2;
+                }
+            }
+            /* else debug_printf("Not finding conflict for file %s (%i)\n", file->file_header.name, file->conflict); */
+
+            file = file->next;
+        }
+    }
+
+    /* if(num_conflicts) debug_printf("%i conflicts\n", num_conflicts); */
+
+    /* every offset must fit in the 4 bytes of a ToC entry */
+    header_size = 16 + toc_index * TOC_ENTRY_SIZE + LOOKUP_TABLE_SIZE + conflict_table_size;
+    offset = header_size;
+
+    for(i = 0; i < toc_index; i++)
+        offset += FILE_HEADER_SIZE + files[i]->file_header.size;
+
+    if(offset > MAX_ARCHIVE_SIZE)
+    {
+        PyErr_SetString(PyExc_OverflowError, "Archive too large, offsets can't exceed 4 GB");
+        goto fail;
+    }
+
+    /* the whole header region is built in memory, and written at once */
+    header = malloc(header_size);
+
+    if (!header)
+    {
+        PyErr_NoMemory();
+        goto fail;
+    }
+
+    p = header;
+    memcpy(p, "\0\0SQUARESOFT", 12);
+    lgp_put_u32(p + 12, toc_index);
+    p += 16;
+
+    offset = header_size;
+
+    for(i = 0; i < toc_index; i++)
+    {
+        struct file_list *file = files[i];
+
+        memcpy(p, file->file_header.name, 20);
+        lgp_put_u32(p + 20, offset);
+        p[24] = 14;
+        lgp_put_u16(p + 25, file->conflict);
+        p += TOC_ENTRY_SIZE;
+
+        offset += FILE_HEADER_SIZE + file->file_header.size;
+    }
+
+    for(i = 0; i < LOOKUP_TABLE_ENTRIES; i++)
+    {
+        lgp_put_u16(p, lookup_table[i].toc_offset);
+        lgp_put_u16(p + 2, lookup_table[i].num_files);
+        p += 4;
+    }
+
+    lgp_put_u16(p, num_conflicts);
+    p += 2;
+
+    for(i = 0; i < num_conflicts; i++)
+    {
+        int j;
+
+        lgp_put_u16(p, num_conflict_entries[i]);
+        p += 2;
+
+        for(j = 0; j < num_conflict_entries[i]; j++)
+        {
+            memcpy(p, conflicts[i][j].name, 128);
+            lgp_put_u16(p + 128, conflicts[i][j].toc_index);
+            p += CONFLICT_ENTRY_SIZE;
+        }
+    }
+
+    if (output_write(out, header, header_size) < 0)
+        goto fail;
+
+#ifdef LGP_THREADS
+    /* every offset is known, the files can be copied in any order */
+    if (out->workers > 1 && out->f && lseek(fileno(out->f), 0, SEEK_CUR) >= 0)
+    {
+        int res = write_parallel(directory, out, files, toc_index);
+
+        free(header);
+        free(files);
+        return res;
+    }
+#endif
+
+    buffer = malloc(COPY_BUFFER_SIZE);
+
+    if (!buffer)
+    {
+        PyErr_NoMemory();
+        goto fail;
+    }
+
+    /* the next file is always opened ahead, so the OS reads it while we copy this one */
+    if (toc_index) next_inf = open_input(directory, files[0]);
+
+    for(i = 0; i < toc_index; i++)
+    {
+        struct file_list *file = files[i];
+        unsigned int left = file->file_header.size;
+        unsigned char file_header[FILE_HEADER_SIZE];
+
+        inf = next_inf;
+        next_inf = NULL;
+
+        if (!inf)
+        {
+            PyErr_Format(PyExc_OSError, "Error opening input file: %s", file->source_name);
+            goto fail;
+        }
+
+        if (i + 1 < toc_index) next_inf = open_input(directory, files[i + 1]);
+
+        encode_file_header(file_header, &file->file_header);
+
+        if (output_write(out, file_header, FILE_HEADER_SIZE) < 0)
+            goto fail;
+
+        while(left)
+        {
+            size_t res;
+
+            Py_BEGIN_ALLOW_THREADS
+            res = fread(buffer, 1, left < COPY_BUFFER_SIZE ? left : COPY_BUFFER_SIZE, inf);
+            Py_END_ALLOW_THREADS
+
+            if (!res)
+            {
+                PyErr_Format(PyExc_OSError, "Could not read input file: %s", file->source_name);
+                goto fail;
+            }
+
+            if (output_write(out, buffer, res) < 0)
+                goto fail;
+
+            left -= res;
+        }
+
+        if (fclose(inf) < 0)
+        {
+            inf = NULL;
+            PyErr_SetString(PyExc_OSError, "Could not close file");
+            goto fail;
+        }
+
+        inf = NULL;
+    }
+
+    if (output_write(out, "FINAL FANTASY7", 14) < 0)
+        goto fail;
+
+    free(header);
+    free(buffer);
+    free(files);
+    return 0;
+
+fail:
+    if (inf) fclose(inf);
+    if (next_inf) fclose(next_inf);
+    free(header);
+    free(buffer);
+    free(files);
+    return -1;
+}
+
+/* List which archive the files of a part went in, one "archive<TAB>path" per
+ * line of the manifest */
+int write_split_manifest(FILE *f, char *name)
+{
+    int i;
+
+    for(i = 0; i < LOOKUP_TABLE_ENTRIES; i++)
+    {
+        struct file_list *file;
+
+        for(file = lookup_list[i]; file; file = file->next)
+            if(fprintf(f, "%s\t%s\n", name, file->source_name + (file->source_name[0] == '/')) < 0)
+            {
+                PyErr_SetString(PyExc_OSError, "Could not write the split manifest");
+                return -1;
+            }
+    }
+
+    return 0;
+}
+
+/* Open a part of the archive, replacing any previous file with that name */
+int open_output(struct lgp_output *out, char *archive)
+{
+    out->stream = NULL;
+
+    if (unlink(archive) && errno != ENOENT)
+    {
+        PyErr_Format(PyExc_OSError, "Could not unlink %s", archive);
+        return -1;
+    }
+
+    out->f = fopen(archive, "wb");
+
+    if(!out->f)
+    {
+        PyErr_Format(PyExc_OSError, "Error opening output file %s", archive);
+        return -1;
+    }
+
+    return 0;
+}
+
+int close_output(struct lgp_output *out)
+{
+    if (out->f && fclose(out->f) < 0)
+    {
+        PyErr_SetString(PyExc_OSError, "Could not close file");
+        return -1;
+    }
+
+    return 0;
+}
+
+static PyObject *
+pack_archives(PyObject *self, PyObject *args, PyObject *keywords)
+{
+    DIR *d;
+    int part;
+    char name[1024];
+    FILE *manifest = NULL;
+    struct file_list *pending = NULL;
+    int pending_index = 0;
+    char *directory;
+    PyObject *output;
+    PyObject *path = NULL;
+    char *archive = NULL;
+    struct lgp_output out = {NULL, NULL, 0};
+    int split = 0;
+    int workers = 0;
+    static char *kwlist[] = {"directory", "archive", "split", "workers", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, keywords, "sO|pi:pack", kwlist, &directory, &output, &split, &workers))
+        return NULL;
+
+    /* a file descriptor, anything with a write() method, or a path */
+    if (PyLong_Check(output))
+    {
+        int fd = PyLong_AsLong(output);
+
+        if (fd < 0 && !PyErr_Occurred())
+            PyErr_SetString(PyExc_ValueError, "Invalid file descriptor");
+        if (fd < 0)
+            return NULL;
+
+        fd = dup(fd);
+        if (fd < 0 || !(out.f = fdopen(fd, "wb")))
+        {
+            if (fd >= 0) close(fd);
+            PyErr_SetString(PyExc_OSError, "Error opening output file descriptor");
+            return NULL;
+        }
+    }
+    else if (PyObject_HasAttrString(output, "write"))
+        out.stream = output;
+    else
+    {
+        if (!PyUnicode_FSConverter(output, &path))
+            return NULL;
+
+        archive = PyBytes_AS_STRING(path);
+
+        if (strlen(archive) > sizeof(name) - 16)
+        {
+            PyErr_Format(PyExc_ValueError, "Path too long: %s", archive);
+            Py_DECREF(path);
+            return NULL;
+        }
+    }
+
+    if (split && !archive)
+    {
+        PyErr_SetString(PyExc_ValueError, "Splitting needs an output file name");
+        goto fail;
+    }
+
+    d = opendir(directory);
+
+    if (!d) {
+        PyErr_SetString(PyExc_OSError, "Error opening input directory");
+        goto fail;
+    }
+
+    reset_file_list();
+    split_output = split;
+
+    if (read_directory(directory, "", d) < 0)
+    {
+        closedir(d);
+        goto fail;
+    }
+
+    closedir(d);
+
+    if (!files_read)
+    {
+        PyErr_SetString(PyExc_ValueError, "No input files found.");
+        goto fail;
+    }
+
+    if (split)
+    {
+        /* the parts are made from the merged runs, one at a time */
+        if (spill_file_list() < 0)
+            goto fail;
+
+        sprintf(name, "%s.parts", archive);
+        manifest = fopen(name, "w");
+
+        if (!manifest)
+        {
+            PyErr_Format(PyExc_OSError, "Error opening output file %s", name);
+            goto fail;
+        }
+    }
+    else sort_file_list();
+
+    for (part = 0; split || !part; part++)
+    {
+        if (split)
+        {
+            int count = load_part(part, &pending, &pending_index);
+
+            if (count < 0)
+                goto fail;
+            if (!count)
+                break;
+        }
+
+        if (archive)
+        {
+            part_name(name, archive, part);
+
+            if (open_output(&out, name) < 0)
+                goto fail;
+        }
+
+        out.workers = workers;
+
+        if (write_archive(directory, &out, part) < 0)
+        {
+            close_output(&out);
+            if (archive) unlink(name);
+            out.f = NULL;
+            goto fail;
+        }
+
+        if (close_output(&out) < 0)
+        {
+            out.f = NULL;
+            goto fail;
+        }
+
+        out.f = NULL;
+
+        if (split)
+        {
+            if (write_split_manifest(manifest, name) < 0)
+                goto fail;
+
+            free_file_list();
+        }
+    }
+
+    if (manifest && fclose(manifest) < 0)
+    {
+        manifest = NULL;
+        PyErr_SetString(PyExc_OSError, "Could not close file");
+        goto fail;
+    }
+
+    /* printf("Successfully created archive with %i file(s) out of %i file(s) total.\n", files_read, files_total); */
+
+    reset_file_list();
+    Py_XDECREF(path);
+
+    Py_RETURN_NONE;
+
+fail:
+    if (out.f) fclose(out.f);
+    if (manifest) fclose(manifest);
+    free_files(pending);
+    reset_file_list();
+    Py_XDECREF(path);
+    return NULL;
+}
+
+/* The packer works on the global file list and tables above, which worker
+ * threads keep using while the GIL is released, so only one pack can run
+ * at a time */
+static PyThread_type_lock pack_lock;
+
+static PyObject *
+lgp_pack(PyObject *self, PyObject *args, PyObject *keywords)
+{
+    PyObject *res;
+
+    if (!PyThread_acquire_lock(pack_lock, NOWAIT_LOCK))
+    {
+        Py_BEGIN_ALLOW_THREADS
+        PyThread_acquire_lock(pack_lock, WAIT_LOCK);
+        Py_END_ALLOW_THREADS
+    }
+
+    res = pack_archives(self, args, keywords);
+    PyThread_release_lock(pack_lock);
+
+    return res;
+}
+
+PyDoc_STRVAR(pack_doc, "Repack a folder into a single LGP archive.\n\n\
+The archive can be a path, a file descriptor or any object with a write()\n\
+method; it is written strictly sequentially, so pipes and sockets work too.\n\
+Files are ordered by name, so packing the same tree twice gives the same bytes.\n\
+If the files don't fit in one archive, OverflowError is raised, unless 'split'\n\
+is true; then they are spread over 'name.lgp' itself, 'name_1.lgp', 'name_2.lgp'\n\
+and so on, and '<archive>.parts' lists which archive each file went in. The\n\
+file list of a split pack is sorted in temporary files, so only one archive's\n\
+worth of it is kept in memory; it holds at most 256 times as many files.\n\
+With 'workers' above 1 and a seekable output, that many threads copy the files\n\
+at once, each straight to its place in the archive.\n\
+Packs called from several threads run one after the other.");
+
+/* unlgp.c part */
+
+struct toc_extent
+{
+    unsigned int offset;
+    int index;
+};
+
+int compare_extents(const void *a, const void *b)
+{
+    const struct toc_extent *x = a;
+    const struct toc_extent *y = b;
+
+    return (x->offset > y->offset) - (x->offset < y->offset);
+}
+
+/* How many bytes there are from each member to the next one (or the end of
+ * the archive), so its header and data can usually be read in one call;
+ * 'order' is filled with the member indices sorted by offset */
+unsigned int *member_extents(struct toc_entry *toc, int num_files, unsigned long long size, int *order)
+{
+    struct toc_extent *sorted = malloc(sizeof(*sorted) * (num_files ? num_files : 1));
+    unsigned int *extents = malloc(sizeof(*extents) * (num_files ? num_files : 1));
+    int i;
+    int j;
+
+    if (!sorted || !extents)
+    {
+        free(sorted);
+        free(extents);
+        return NULL;
+    }
+
+    for (i = 0; i < num_files; i++)
+    {
+        sorted[i].offset = toc[i].offset;
+        sorted[i].index = i;
+    }
+
+    qsort(sorted, num_files, sizeof(*sorted), compare_extents);
+
+    for (i = 0; i < num_files; i++)
+    {
+        unsigned long long next = size;
+
+        /* members sharing their data have the same offset */
+        for (j = i + 1; j < num_files && sorted[j].offset == sorted[i].offset; j++);
+
+        if (j < num_files) next = sorted[j].offset;
+
+        next = next > sorted[i].offset ? next - sorted[i].offset : 0;
+
+        if (next > COPY_BUFFER_SIZE) next = COPY_BUFFER_SIZE;
+        if (next < 24) next = 24;
+
+        extents[sorted[i].index] = next;
+        order[i] = sorted[i].index;
+    }
+
+    free(sorted);
+    return extents;
+}
+
+/* Match 'c' against the character class at 'pattern', just past its '[',
+ * like fnmatch does: a leading '!' negates it, a ']' right after that is part
+ * of it, and 'a-z' is a range. Returns -1 if the class is never closed, and
+ * then '[' is an ordinary character; otherwise 'end' is set past the ']'. */
+int class_match(const char *pattern, int c, const char **end)
+{
+    int negate = *pattern == '!';
+    int found = 0;
+    const char *p = pattern + negate;
+
+    c = tolower(c);
+
+    do
+    {
+        int low;
+        int high;
+
+        if (!*p) return -1;
+
+        low = high = tolower((unsigned char)*p++);
+
+        if (p[0] == '-' && p[1] && p[1] != ']')
+        {
+            high = tolower((unsigned char)p[1]);
+            p += 2;
+        }
+
+        if (low <= c && c <= high) found = 1;
+    }
+    while (*p != ']');
+
+    *end = p + 1;
+    return found != negate;
+}
+
+/* Shell-style match of 'name' against 'pattern', where '*' matches any run of
+ * characters, '?' any single one and '[...]' any one of a set, regardless of
+ * ASCII case */
+int glob_match(const char *pattern, const char *name)
+{
+    const char *star = NULL;
+    const char *retry = NULL;
+
+    while (*name)
+    {
+        const char *end = pattern + 1;
+        int res = -1;
+
+        if (*pattern == '[')
+            res = class_match(pattern + 1, (unsigned char)*name, &end);
+
+        if (res < 0)
+            res = *pattern && (*pattern == '?' || tolower((unsigned char)*pattern) == tolower((unsigned char)*name));
+
+        if (*pattern == '*')
+        {
+            star = ++pattern;
+            retry = name;
+        }
+        else if (res)
+        {
+            pattern = end;
+            name++;
+        }
+        else if (star)
+        {
+            pattern = star;
+            name = ++retry;
+        }
+        else
+            return 0;
+    }
+
+    while (*pattern == '*') pattern++;
+
+    return !*pattern;
+}
+
+/* Whether 'path' matches a pattern or any of a sequence of patterns;
+ * -1 with an exception set if they aren't strings */
+int matches_any(PyObject *patterns, const char *path)
+{
+    PyObject *seq;
+    Py_ssize_t i;
+    int res = 0;
+
+    if (PyUnicode_Check(patterns))
+    {
+        const char *pattern = PyUnicode_AsUTF8(patterns);
+
+        return pattern ? glob_match(pattern, path) : -1;
+    }
+
+    seq = PySequence_Fast(patterns, "patterns must be a string or a sequence of strings");
+    if (!seq)
+        return -1;
+
+    for (i = 0; i < PySequence_Fast_GET_SIZE(seq) && !res; i++)
+    {
+        const char *pattern = PyUnicode_AsUTF8(PySequence_Fast_GET_ITEM(seq, i));
+
+        if (!pattern)
+            res = -1;
+        else
+            res = glob_match(pattern, path);
+    }
+
+    Py_DECREF(seq);
+    return res;
+}
+
+int write_all(int fd, const char *data, size_t size)
+{
+    while (size)
+    {
+        Py_ssize_t res = write(fd, data, size);
+
+        if (res <= 0) return -1;
+
+        data += res;
+        size -= res;
+    }
+
+    return 0;
+}
+
+/* Copy 'size' bytes at 'offset' of the archive to 'out', in the kernel if possible */
+int copy_data(int in, int out, unsigned long long offset, size_t size, char *buffer)
+{
+#ifdef __linux__
+    while (size)
+    {
+        loff_t off = offset;
+        Py_ssize_t res = copy_file_range(in, &off, out, NULL, size, 0);
+
+        /* not supported between those files, fall back to reading */
+        if (res <= 0) break;
+
+        offset += res;
+        size -= res;
+    }
+#endif
+
+    while (size)
+    {
+        Py_ssize_t res = pread(in, buffer, size < COPY_BUFFER_SIZE ? size : COPY_BUFFER_SIZE, offset);
+
+        if (res <= 0 || write_all(out, buffer, res) < 0) return -1;
+
+        offset += res;
+        size -= res;
+    }
+
+    return 0;
+}
+
+/* Open the archive for reading, when it wasn't created from a buffer */
+int lgp_open(_LGPObject *self)
+{
+    int fd = -1;
+
+    if (self->path)
+        fd = open(PyBytes_AS_STRING(self->path), O_RDONLY | O_BINARY);
+    else if (self->fd >= 0)
+        fd = dup(self->fd);
+
+    if (fd < 0)
+        PyErr_SetString(PyExc_OSError, "Error opening input file");
+
+    return fd;
+}
+
+/* Read as much as possible of 'size' bytes at 'offset', returns how much was read */
+size_t pread_all(int fd, unsigned char *data, size_t size, unsigned long long offset)
+{
+    size_t done = 0;
+
+    while (done < size)
+    {
+        Py_ssize_t res = pread(fd, data + done, size - done, offset + done);
+
+        if (res <= 0) break;
+
+        done += res;
+    }
+
+    return done;
+}
+
+/* Read the header region of an archive into one buffer. The conflicts table
+ * has no size of its own, it ends where the first file starts. If the file
+ * is too short, the buffer is too, and decode_header() reports where. */
+unsigned char *read_header(int fd, size_t *size)
+{
+    unsigned char start[16];
+    unsigned char *data;
+    unsigned long long fixed;
+    unsigned long long end;
+    unsigned int num_files;
+    unsigned int i;
+
+    *size = pread_all(fd, start, 16, 0);
+    num_files = *size == 16 ? lgp_get_u32(start + 12) : 0;
+
+    if (num_files > MAX_FILES) num_files = MAX_FILES;
+
+    fixed = 16 + (unsigned long long)num_files * TOC_ENTRY_SIZE + LOOKUP_TABLE_SIZE + 2;
+    data = malloc(fixed);
+
+    if (!data)
+    {
+        PyErr_NoMemory();
+        return NULL;
+    }
+
+    *size = pread_all(fd, data, fixed, 0);
+
+    if (*size < fixed || !lgp_get_u16(data + fixed - 2))
+        return data;
+
+    end = HEADER_SIZE_MAX(num_files);
+
+    for (i = 0; i < num_files; i++)
+    {
+        unsigned int offset = lgp_get_u32(data + 16 + i * TOC_ENTRY_SIZE + 20);
+
+        if (offset >= fixed && offset < end) end = offset;
+    }
+
+    if (end > fixed)
+    {
+        unsigned char *more = realloc(data, end);
+
+        if (!more)
+        {
+            free(data);
+            PyErr_NoMemory();
+            return NULL;
+        }
+
+        data = more;
+        *size += pread_all(fd, data + fixed, end - fixed, fixed);
+    }
+
+    return data;
+}
+
+/* The header of an archive, decoded */
+struct lgp_header
+{
+    int num_files;
+    struct toc_entry *toc;
+    struct lookup_table_entry *lookup_table;
+    unsigned short num_conflicts;
+    unsigned short num_conflict_entries[MAX_CONFLICTS];
+    struct conflict_entry *conflicts[MAX_CONFLICTS];
+    struct conflict_entry *entries;     /* where all of conflicts[] point */
+};
+
+void free_header(struct lgp_header *header)
+{
+    free(header->toc);
+    free(header->lookup_table);
+    free(header->entries);
+}
+
+/* Decode the header region from a buffer, checking it doesn't go past its end */
+int decode_header(const unsigned char *data, size_t size, struct lgp_header *header)
+{
+    const unsigned char *p = data + 16;
+    const unsigned char *end = data + size;
+    size_t used = 0;
+    int i;
+    int k;
+
+    memset(header, 0, sizeof(*header));
+
+    if (size < 16)
+    {
+        PyErr_SetString(PyExc_EOFError, "Unexpected EOF reached in archive header");
+        return -1;
+    }
+
+    header->num_files = lgp_get_u32(data + 12);
+
+    if (header->num_files < 0 || header->num_files > MAX_FILES)
+    {
+        PyErr_Format(PyExc_ValueError, "Invalid number of files: %u", lgp_get_u32(data + 12));
+        return -1;
+    }
+
+    if ((size_t)(end - p) < (size_t)header->num_files * TOC_ENTRY_SIZE)
+    {
+        PyErr_SetString(PyExc_EOFError, "Unexpected EOF reached in ToC");
+        return -1;
+    }
+
+    header->toc = malloc(sizeof(*header->toc) * (header->num_files ? header->num_files : 1));
+    header->lookup_table = malloc(sizeof(*header->lookup_table) * LOOKUP_TABLE_ENTRIES);
+
+    if (!header->toc || !header->lookup_table)
+    {
+        PyErr_NoMemory();
+        goto fail;
+    }
+
+    for(i = 0; i < header->num_files; i++)
+    {
+        memcpy(header->toc[i].name, p, 20);
+        header->toc[i].offset = lgp_get_u32(p + 20);
+        header->toc[i].unknown = p[24];
+        header->toc[i].conflict = lgp_get_u16(p + 25);
+        p += TOC_ENTRY_SIZE;
+    }
+
+    if (end - p < LOOKUP_TABLE_SIZE)
+    {
+        PyErr_SetString(PyExc_EOFError, "Unexpected EOF reached in lookup table");
+        goto fail;
+    }
+
+    for(i = 0; i < LOOKUP_TABLE_ENTRIES; i++)
+    {
+        header->lookup_table[i].toc_offset = lgp_get_u16(p);
+        header->lookup_table[i].num_files = lgp_get_u16(p + 2);
+        p += 4;
+    }
+
+    if (end - p < 2)
+    {
+        PyErr_SetString(PyExc_EOFError, "Unexpected EOF reached while reading conflicts");
+        goto fail;
+    }
+
+    header->num_conflicts = lgp_get_u16(p);
+    p += 2;
+
+    if (header->num_conflicts > MAX_CONFLICTS)
+    {
+        PyErr_Format(PyExc_ValueError, "Too many conflicts: %i", header->num_conflicts);
+        goto fail;
+    }
+
+    /* there can't be more entries than what's left of the buffer */
+    header->entries = malloc(sizeof(*header->entries) * ((end - p) / CONFLICT_ENTRY_SIZE + 1));
+
+    if (!header->entries)
+    {
+        PyErr_NoMemory();
+        goto fail;
+    }
+
+    for(k = 0; k < header->num_conflicts; k++)
+    {
+        int j;
+
+        if (end - p < 2)
+        {
+            PyErr_SetString(PyExc_EOFError, "Unexpected EOF reached in conflicts table");
+            goto fail;
+        }
+
+        header->num_conflict_entries[k] = lgp_get_u16(p);
+        header->conflicts[k] = header->entries + used;
+        p += 2;
+
+        if ((size_t)(end - p) < (size_t)header->num_conflict_entries[k] * CONFLICT_ENTRY_SIZE)
+        {
+            PyErr_SetString(PyExc_EOFError, "Unexpected EOF reached in conflicts parsing");
+            goto fail;
+        }
+
+        for(j = 0; j < header->num_conflict_entries[k]; j++)
+        {
+            memcpy(header->conflicts[k][j].name, p, 128);
+            header->conflicts[k][j].toc_index = lgp_get_u16(p + 128);
+            p += CONFLICT_ENTRY_SIZE;
+        }
+
+        used += header->num_conflict_entries[k];
+    }
+
+    return 0;
+
+fail:
+    free_header(header);
+    memset(header, 0, sizeof(*header));
+    return -1;
+}
+
+static PyObject *
+lgp_unpack(_LGPObject *self, PyObject *args, PyObject *keywords)
+{
+    static char *kwlist[] = {"folder", "include", "exclude", "incremental", NULL};
+    PyObject *folder = NULL;
+    PyObject *include = NULL;
+    PyObject *exclude = NULL;
+    int incremental = 0;
+    const char *output;
+    int num_files;
+    int i;
+    int n;
     int files_written = 0;
-    unsigned short num_conflicts;
+    struct lgp_header header;
     struct toc_entry *toc;
-    struct lookup_table_entry *lookup_table;
-    struct conflict_entry *conflicts[MAX_CONFLICTS];
-    int num_conflict_entries[MAX_CONFLICTS];
+    unsigned char *header_data = NULL;
+    size_t header_size;
+    int *lookup_indices = NULL;
+    unsigned int *extents = NULL;
+    int *order = NULL;
+    char *buffer = NULL;
+    int in = -1;
     /* Verbosity level for various purposes 
      * 0 = Only warnings are displayed
      * 1 = Some information is displayed as well
@@ -421,146 +1843,117 @@ lgp_unpack(_LGPObject *self, PyObject *args)
      */
     int verbosity = 0;
 
-    if (!self->file)
-    {
-        PyErr_SetString(PyExc_RuntimeError, "Filename was lost, cannot unpack");
+    if (!PyArg_ParseTupleAndKeywords(args, keywords, "|O&OOp:unpack", kwlist, PyUnicode_FSConverter, &folder, &include, &exclude, &incremental))
         return NULL;
-    }
 
-    f = fopen(self->file, "rb");
+    if (include == Py_None) include = NULL;
+    if (exclude == Py_None) exclude = NULL;
 
-    if (!f)
+    if (!folder)
     {
-        PyErr_SetString(PyExc_OSError, "Error opening input file");
-        return NULL;
-    }
+        if (!self->path)
+        {
+            PyErr_SetString(PyExc_TypeError, "An output folder is needed when not unpacking from a file name");
+            return NULL;
+        }
 
-    if (!fread(tmp, 12, 1, f) || !fread(&num_files, 4, 1, f))
-    {
-        PyErr_SetString(PyExc_EOFError, "Unexpected EOF reached in archive header");
-        goto fail_1;
+        folder = PyBytes_FromFormat("%s_output", PyBytes_AS_STRING(self->path));
+        if (!folder)
+            return NULL;
     }
 
-    if (verbosity > 0)
-        PySys_WriteStdout("Number of files in archive: %i\n", num_files);
+    output = PyBytes_AS_STRING(folder);
 
-    toc = malloc(sizeof(*toc) * num_files);
-    for(i = 0; i < num_files; i++)
+    if (strlen(output) > 256)
     {
-        if (!fread(&toc[i].name, 20, 1, f) ||
-            !fread(&toc[i].offset, 4, 1, f) ||
-            !fread(&toc[i].unknown, 1, 1, f) ||
-            !fread(&toc[i].conflict, 2, 1, f))
-        {
-            PyErr_SetString(PyExc_EOFError, "Unexpected EOF reached in ToC");
-            goto fail_2;
-        }
+        PyErr_Format(PyExc_ValueError, "Path too long: %s", output);
+        Py_DECREF(folder);
+        return NULL;
     }
 
-    lookup_table = malloc(sizeof(*lookup_table) * LOOKUP_TABLE_ENTRIES);
-    for(i = 0; i < LOOKUP_TABLE_ENTRIES; i++)
+    if (mkdir(output, 0777) && errno != EEXIST)
     {
-        if (!fread(&lookup_table[i].toc_offset, 2, 1, f) ||
-            !fread(&lookup_table[i].num_files, 2, 1, f))
-        {
-            PyErr_SetString(PyExc_EOFError, "Unexpected EOF reached in lookup table");
-            goto fail_3;
-        }
+        PyErr_Format(PyExc_OSError, "Could not create directory %s", output);
+        Py_DECREF(folder);
+        return NULL;
     }
 
-    if (!fread(&num_conflicts, 2, 1, f))
+    /* the header is decoded from a single buffer, read at once from a file */
+    if (self->view.obj)
     {
-        PyErr_SetString(PyExc_EOFError, "Unexpected EOF reached while reading conflicts");
-        goto fail_3;
+        if (decode_header(self->view.buf, self->view.len, &header) < 0)
+            goto fail_1;
     }
-
-    if (verbosity > 0)
-        PySys_WriteStdout("%i conflicts\n", num_conflicts);
-
-    for(k = 0; k < num_conflicts; k++)
+    else
     {
-        if (!fread(&num_conflict_entries[k], 2, 1, f))
-        {
-            PyErr_SetString(PyExc_EOFError, "Unexpected EOF reached in conflicts table");
-            goto fail_3;
-        }
-
-        if (verbosity > 1)
-            PySys_WriteStdout("%i: %i conflict entries\n", i, num_conflict_entries[k]);
+        in = lgp_open(self);
 
-        conflicts[k] = malloc(sizeof(**conflicts) * num_conflict_entries[k]);
+        if (in < 0 || !(header_data = read_header(in, &header_size)))
+            goto fail_1;
 
-        if (!fread(&conflicts[k]->name, 128, 1, f) ||
-            !fread(&conflicts[k]->toc_index, 2, 1, f))
-        {
-            PyErr_SetString(PyExc_EOFError, "Unexpected EOF reached in conflicts parsing");
-            goto fail_4;
-        }
+        if (decode_header(header_data, header_size, &header) < 0)
+            goto fail_1;
     }
 
-    if (verbosity > 0)
-        PySys_WriteStdout("Done dealing with conflicts\n");
+    num_files = header.num_files;
+    toc = header.toc;
 
-    for(i = 0; i < num_files; i++)
-    {
-        struct file_header *file_header;
-        void *data;
-        FILE *of;
-        int lookup_value1;
-        int lookup_value2;
-        struct lookup_table_entry *lookup_result;
-        int resolved_conflict = 0;
-        char name[256];
+    if (verbosity > 0)
+        PySys_WriteStdout("Number of files in archive: %i\n", num_files);
+    if (verbosity > 0)
+        PySys_WriteStdout("%i conflicts\n", header.num_conflicts);
 
-        if (verbosity > 1)
-            PySys_WriteStdout("%i; Name: %s, offset: 0x%x, unknown: 0x%x, conflict: %i\n", i, toc[i].name, toc[i].offset, toc[i].unknown, toc[i].conflict);
+    lookup_indices = malloc(sizeof(*lookup_indices) * (num_files ? num_files : 1));
+    order = malloc(sizeof(*order) * (num_files ? num_files : 1));
 
-        if (fseek(f, toc[i].offset, SEEK_SET))
-        {
-            PyErr_SetString(PyExc_EOFError, "Unexpected EOF in file header seeking");
-            goto fail_4;
-        }
+    if (!lookup_indices || !order)
+    {
+        PyErr_NoMemory();
+        goto fail_2;
+    }
 
-        file_header = malloc(sizeof(*file_header));
+    lgp_lookup_indices(toc->name, sizeof(*toc), num_files, lookup_indices);
 
-        if (!fread(&file_header->name, 20, 1, f) ||
-            !fread(&file_header->size, 4, 1, f))
+    /* members are read straight from the file descriptor */
+    if (self->view.obj)
+    {
+        if (!(extents = member_extents(toc, num_files, self->view.len, order)))
         {
-            PyErr_SetString(PyExc_EOFError, "Unexpected EOF in file header parsing");
-            free(file_header);
-            goto fail_4;
+            PyErr_NoMemory();
+            goto fail_2;
         }
+    }
+    else
+    {
+        struct stat st;
 
-        if (verbosity > 1)
-            PySys_WriteStdout("%i; Name: %s, size: %i\n", i, file_header->name, file_header->size);
-        if (verbosity > 2)
-            PySys_WriteStdout("%s %s\n", toc[i].name, file_header->name);
+        buffer = malloc(COPY_BUFFER_SIZE);
 
-        if(!strcmp(toc[i].name, file_header->name/*, 20*/))
+        if (!buffer || fstat(in, &st) ||
+            !(extents = member_extents(toc, num_files, st.st_size, order)))
         {
-            PyErr_Format(PyExc_ValueError, "Offset error: %s", toc[i].name);
-            free(file_header);
-            goto fail_4;
+            PyErr_NoMemory();
+            goto fail_2;
         }
+    }
 
-        lookup_value1 = lgp_lookup_value(toc[i].name[0]);
-        lookup_value2 = lgp_lookup_value(toc[i].name[1]);
+    /* going through the members by offset keeps the reads sequential */
+    for(n = 0; n < num_files; n++)
+    {
+        struct file_header file_header;
+        char *data;
+        size_t available;
+        int of;
+        struct lookup_table_entry *lookup_result = NULL;
+        int resolved_conflict = 0;
+        char name[1024];
 
-        lookup_result = &lookup_table[lookup_value1 * LOOKUP_VALUE_MAX + lookup_value2 + 1];
+        i = order[n];
 
-        if (verbosity > 2)
-            PySys_WriteStdout("%i; %i - %i\n", i, (lookup_result->toc_offset - 1), (lookup_result->toc_offset - 1 + lookup_result->num_files));
         if (verbosity > 1)
-            PySys_WriteStdout("i: %i\ntoc offset: %i\nnum files: %i\n", i, lookup_result->toc_offset, lookup_result->num_files);
+            PySys_WriteStdout("%i; Name: %.20s, offset: 0x%x, unknown: 0x%x, conflict: %i\n", i, toc[i].name, toc[i].offset, toc[i].unknown, toc[i].conflict);
 
-        if ((i < (lookup_result->toc_offset - 1) || i > (lookup_result->toc_offset - 1 + lookup_result->num_files)) && verbosity > -1)
-            PySys_WriteStdout("Warning: Broken lookup table, FF7 may not be able to find %s\n", toc[i].name);
-
-        strcpy(name, self->file);
-        strcat(name, "_output");
-        mkdir(name, 0777);
-        strcat(name, "/");
-        strcat(name, toc[i].name);
+        sprintf(name, "%s/%.20s", output, toc[i].name);
 
         if(toc[i].conflict != 0)
         {
@@ -568,13 +1961,13 @@ lgp_unpack(_LGPObject *self, PyObject *args)
             int conflict = toc[i].conflict - 1;
 
             if (verbosity > 1)
-                PySys_WriteStdout("Trying to resolve conflict %i for %i (%s)\n", conflict, i, toc[i].name);
+                PySys_WriteStdout("Trying to resolve conflict %i for %i (%.20s)\n", conflict, i, toc[i].name);
 
-            for(j = 0; j < num_conflict_entries[conflict]; j++)
+            for(j = 0; conflict < header.num_conflicts && j < header.num_conflict_entries[conflict]; j++)
             {
-                if(conflicts[conflict][j].toc_index == i)
+                if(header.conflicts[conflict][j].toc_index == i)
                 {
-                    sprintf(name, "%s/%s", conflicts[conflict][j].name, toc[i].name);
+                    sprintf(name, "%s/%.128s/%.20s", output, header.conflicts[conflict][j].name, toc[i].name);
                     if (verbosity > 1)
                         PySys_WriteStdout("Conflict resolved to %s\n", name);
                     resolved_conflict = 1;
@@ -584,10 +1977,96 @@ lgp_unpack(_LGPObject *self, PyObject *args)
 
             if(!resolved_conflict)
             {
-                PyErr_Format(PyExc_ValueError, "Unresolved conflict for %s", toc[i].name);
-                free(file_header);
-                goto fail_4;
+                PyErr_Format(PyExc_ValueError, "Unresolved conflict for %.20s", toc[i].name);
+                goto fail_2;
+            }
+        }
+
+        /* filter on the path inside the folder before reading anything */
+        if (include || exclude)
+        {
+            const char *path = name + strlen(output) + 1;
+            int included = include ? matches_any(include, path) : 1;
+            int excluded = included > 0 && exclude ? matches_any(exclude, path) : 0;
+
+            if (included < 0 || excluded < 0)
+                goto fail_2;
+
+            if (!included || excluded)
+                continue;
+        }
+
+        /* one read gets the header and, most of the time, all of the data */
+        if (self->view.obj)
+        {
+            if ((unsigned long long)toc[i].offset + FILE_HEADER_SIZE > (unsigned long long)self->view.len)
+            {
+                PyErr_SetString(PyExc_EOFError, "Unexpected EOF in file header parsing");
+                goto fail_2;
+            }
+
+            data = (char *)self->view.buf + toc[i].offset;
+            available = self->view.len - toc[i].offset;
+        }
+        else
+        {
+            /* members found up to date are skipped, so their data isn't read
+             * until it's known to be needed, then copy_data() takes it all */
+            size_t size = incremental ? FILE_HEADER_SIZE : extents[i] < COPY_BUFFER_SIZE ? extents[i] : COPY_BUFFER_SIZE;
+            Py_ssize_t res = pread(in, buffer, size, toc[i].offset);
+
+            if (res < FILE_HEADER_SIZE)
+            {
+                PyErr_SetString(PyExc_EOFError, "Unexpected EOF in file header parsing");
+                goto fail_2;
             }
+
+            data = buffer;
+            available = res;
+        }
+
+        memcpy(file_header.name, data, 20);
+        file_header.size = lgp_get_u32((unsigned char *)data + 20);
+        data += FILE_HEADER_SIZE;
+        available -= FILE_HEADER_SIZE;
+
+        if (available > file_header.size) available = file_header.size;
+
+        if (self->view.obj && available < file_header.size)
+        {
+            PyErr_SetString(PyExc_ValueError, "Could not read data");
+            goto fail_2;
+        }
+
+        if (verbosity > 1)
+            PySys_WriteStdout("%i; Name: %.20s, size: %i\n", i, file_header.name, file_header.size);
+        if (verbosity > 2)
+            PySys_WriteStdout("%.20s %.20s\n", toc[i].name, file_header.name);
+
+        if(strncmp(toc[i].name, file_header.name, 20))
+        {
+            PyErr_Format(PyExc_ValueError, "Offset error: %.20s", toc[i].name);
+            goto fail_2;
+        }
+
+        if (lookup_indices[i] >= 0)
+            lookup_result = &header.lookup_table[lookup_indices[i]];
+
+        if (lookup_result && verbosity > 2)
+            PySys_WriteStdout("%i; %i - %i\n", i, (lookup_result->toc_offset - 1), (lookup_result->toc_offset - 1 + lookup_result->num_files));
+        if (lookup_result && verbosity > 1)
+            PySys_WriteStdout("i: %i\ntoc offset: %i\nnum files: %i\n", i, lookup_result->toc_offset, lookup_result->num_files);
+
+        if ((!lookup_result || i < (lookup_result->toc_offset - 1) || i >= (lookup_result->toc_offset - 1 + lookup_result->num_files)) && verbosity > -1)
+            PySys_WriteStdout("Warning: Broken lookup table, FF7 may not be able to find %.20s\n", toc[i].name);
+
+        /* a file of the right size is taken as up to date, and left alone */
+        if (incremental)
+        {
+            struct stat st;
+
+            if (!stat(name, &st) && S_ISREG(st.st_mode) && (unsigned long long)st.st_size == file_header.size)
+                continue;
         }
 
         if (verbosity > 1)
@@ -599,7 +2078,7 @@ lgp_unpack(_LGPObject *self, PyObject *args)
 
             while((next = strchr(next, '/')))
             {
-                char tmp[256];
+                char tmp[1024];
 
                 while(next[0] == '/') next++;
 
@@ -609,48 +2088,36 @@ lgp_unpack(_LGPObject *self, PyObject *args)
                 if (verbosity > 1)
                     PySys_WriteStdout("Creating directory %s\n", tmp);
 
-                if (!mkdir(tmp, 0777))
+                if (mkdir(tmp, 0777) && errno != EEXIST)
                 {
                     PyErr_Format(PyExc_OSError, "Could not create directory %s", tmp);
-                    free(file_header);
-                    goto fail_4;
+                    goto fail_2;
                 }
             }
         }
 
-        data = malloc(file_header->size);
+        of = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0666);
 
-        if (!fread(data, file_header->size, 1, f))
+        if(of < 0)
         {
-            PyErr_SetString(PyExc_ValueError, "Could not read data");
-            free(file_header);
-            free(data);
-            goto fail_4;
+            PyErr_Format(PyExc_OSError, "Error opening output file %s", name);
+            goto fail_2;
         }
 
-        of = fopen(name, "wb");
-        PySys_WriteStdout("After opening file, trying to write\n");
-
-        if(!of)
+        /* whatever wasn't read along with the header is copied in the kernel */
+        if (write_all(of, data, available) < 0 ||
+            copy_data(in, of, (unsigned long long)toc[i].offset + FILE_HEADER_SIZE + available, file_header.size - available, buffer) < 0)
         {
-            PyErr_Format(PyExc_OSError, "Error opening output file %s", name);
-            free(file_header);
-            free(data);
-            goto fail_4;
+            PyErr_Format(PyExc_OSError, "Could not write %s", name);
+            close(of);
+            goto fail_2;
         }
 
-        if (!fwrite(data, file_header->size, 1, of))
+        if (close(of) < 0)
         {
-            PyErr_Format(PyExc_OSError, "Could not write %s to %s", name, tmp);
-            free(file_header);
-            free(data);
-            goto fail_4;
+            PyErr_Format(PyExc_OSError, "Could not write %s", name);
+            goto fail_2;
         }
-        PySys_WriteStdout("After writing\n");
-
-        fclose(of);
-        free(file_header);
-        free(data);
 
         files_written++;
     }
@@ -658,65 +2125,436 @@ lgp_unpack(_LGPObject *self, PyObject *args)
     if (verbosity > 0)
         PySys_WriteStdout("Successfully extracted %i file(s) out of %i file(s) total\n", files_written, num_files);
 
-    fclose(f);
-    free(toc);
-    free(lookup_table);
-
-    for (i = 0; i < (k+1) && i < num_conflicts; i++)
-        free(conflicts[i]);
+    free_header(&header);
+    free(header_data);
+    free(lookup_indices);
+    free(extents);
+    free(order);
+    free(buffer);
+    if (in >= 0) close(in);
 
+    Py_DECREF(folder);
     Py_RETURN_NONE;
 
-fail_4:
-    for (i = 0; i < num_conflicts; i++)
-        free(conflicts[i]);
-fail_3:
-    free(lookup_table);
 fail_2:
-    free(toc);
+    free_header(&header);
+    free(lookup_indices);
+    free(extents);
+    free(order);
+    free(buffer);
 fail_1:
-    fclose(f);
+    free(header_data);
+    if (in >= 0) close(in);
+    Py_DECREF(folder);
     return NULL;
 
 }
 
-PyDoc_STRVAR(unpack_doc, "Unpack the LGP archive into a single folder.");
+PyDoc_STRVAR(unpack_doc, "Unpack the LGP archive into a single folder.\n\n\
+The folder defaults to the archive's file name followed by '_output'; it must\n\
+be given when the archive was opened from a file descriptor or a buffer.\n\
+'include' and 'exclude' are glob patterns as in fnmatch, or sequences of them,\n\
+matched regardless of case against each member's path inside the folder; only\n\
+members matching 'include' (when given) and not matching 'exclude' are written.\n\
+With 'incremental', files already in the folder with the right size are kept.");
+
+/* search part */
+
+struct search_hit
+{
+    Py_ssize_t offset;
+    Py_ssize_t pattern;
+};
+
+int compare_hits(const void *a, const void *b)
+{
+    const struct search_hit *x = a;
+    const struct search_hit *y = b;
+
+    if (x->offset != y->offset)
+        return (x->offset > y->offset) - (x->offset < y->offset);
+
+    return (x->pattern > y->pattern) - (x->pattern < y->pattern);
+}
+
+static PyObject *
+lgp_find(PyObject *self, PyObject *args)
+{
+    Py_buffer data;
+    PyObject *patterns;
+    PyObject *seq;
+    PyObject *result = NULL;
+    Py_buffer *needles;
+    struct search_hit *hits;
+    Py_ssize_t num;
+    Py_ssize_t count = 0;
+    Py_ssize_t allocated = 64;
+    Py_ssize_t i;
+
+    if (!PyArg_ParseTuple(args, "y*O:find", &data, &patterns))
+        return NULL;
+
+    seq = PySequence_Fast(patterns, "patterns must be a sequence of bytes-like objects");
+    if (!seq)
+    {
+        PyBuffer_Release(&data);
+        return NULL;
+    }
+
+    num = PySequence_Fast_GET_SIZE(seq);
+    needles = PyMem_Calloc(num ? num : 1, sizeof(*needles));
+    hits = malloc(sizeof(*hits) * allocated);
+
+    if (!needles || !hits)
+    {
+        PyErr_NoMemory();
+        num = 0;
+        goto done;
+    }
+
+    for (i = 0; i < num; i++)
+    {
+        if (PyObject_GetBuffer(PySequence_Fast_GET_ITEM(seq, i), &needles[i], PyBUF_SIMPLE) < 0)
+        {
+            num = i;
+            goto done;
+        }
+
+        if (!needles[i].len)
+        {
+            PyErr_SetString(PyExc_ValueError, "Empty search pattern");
+            num = i + 1;
+            goto done;
+        }
+    }
+
+    /* the buffers stay valid while we hold them, so other threads can run */
+    Py_BEGIN_ALLOW_THREADS
+    for (i = 0; i < num && hits; i++)
+    {
+        const char *start = data.buf;
+        const char *end = start + data.len;
+        const char *p = start;
+
+        while ((p = memmem(p, end - p, needles[i].buf, needles[i].len)))
+        {
+            if (count == allocated)
+            {
+                struct search_hit *more = realloc(hits, sizeof(*hits) * allocated * 2);
+
+                if (!more)
+                {
+                    free(hits);
+                    hits = NULL;
+                    break;
+                }
+
+                hits = more;
+                allocated *= 2;
+            }
+
+            hits[count].offset = p - start;
+            hits[count].pattern = i;
+            count++;
+            p++;
+        }
+    }
+
+    if (hits)
+        qsort(hits, count, sizeof(*hits), compare_hits);
+    Py_END_ALLOW_THREADS
+
+    if (!hits)
+    {
+        PyErr_NoMemory();
+        goto done;
+    }
+
+    result = PyList_New(count);
+
+    for (i = 0; result && i < count; i++)
+    {
+        PyObject *hit = Py_BuildValue("(nn)", hits[i].offset, hits[i].pattern);
+
+        if (!hit)
+        {
+            Py_CLEAR(result);
+            break;
+        }
+
+        PyList_SET_ITEM(result, i, hit);
+    }
+
+done:
+    for (i = 0; i < num; i++)
+        PyBuffer_Release(&needles[i]);
+    PyMem_Free(needles);
+    free(hits);
+    Py_DECREF(seq);
+    PyBuffer_Release(&data);
+    return result;
+}
+
+PyDoc_STRVAR(find_doc, "find(data, patterns) -> list of (offset, index)\n\n\
+Find every occurrence of each of the byte strings in 'patterns' within\n\
+'data', sorted by offset; 'index' tells which pattern was found there.\n\
+Overlapping occurrences are all reported. The GIL is released while\n\
+searching, so several threads can search at the same time.");
+
+/* tex part */
+
+/* the header of a TEX file is 0xEC bytes of little-endian integers,
+ * followed by the palettes if any, then the pixels */
+#define TEX_HEADER_SIZE 0xEC
+#define TEX_COLOR_KEY 0x08
+#define TEX_WIDTH 0x3C
+#define TEX_HEIGHT 0x40
+#define TEX_PALETTE_FLAG 0x4C
+#define TEX_PALETTE_SIZE 0x58
+#define TEX_COLORS_PER_PALETTE 0x34
+#define TEX_BYTES_PER_PIXEL 0x68
+#define TEX_ALPHA_BITS 0x78
+#define TEX_MASKS 0x7C
+#define TEX_SHIFTS 0x8C
+
+/* RGBA of a direct color pixel, from the channel masks and shifts */
+void tex_color(const unsigned char *header, unsigned int value, int color_key, unsigned char *rgba)
+{
+    int c;
+
+    for (c = 0; c < 4; c++)
+    {
+        unsigned int mask = lgp_get_u32(header + TEX_MASKS + c * 4);
+        unsigned int shift = lgp_get_u32(header + TEX_SHIFTS + c * 4) & 31;
+        unsigned int max = mask >> shift;
+
+        rgba[c] = max ? ((value & mask) >> shift) * 255 / max : 0;
+    }
+
+    if (!lgp_get_u32(header + TEX_ALPHA_BITS)) rgba[3] = 255;
+    if (color_key && !rgba[0] && !rgba[1] && !rgba[2]) rgba[3] = 0;
+}
+
+static PyObject *
+lgp_decode_tex(PyObject *self, PyObject *args, PyObject *keywords)
+{
+    static char *kwlist[] = {"data", "palette", NULL};
+    Py_buffer data;
+    int palette = 0;
+    const unsigned char *header;
+    const unsigned char *pixels;
+    unsigned int width, height, bytes_per_pixel, palette_size, colors, color_key;
+    unsigned long long count;
+    unsigned int *lut = NULL;
+    PyObject *image = NULL;
+    unsigned char *out;
+
+    if (!PyArg_ParseTupleAndKeywords(args, keywords, "y*|i:decode_tex", kwlist, &data, &palette))
+        return NULL;
+
+    header = data.buf;
+
+    if (data.len < TEX_HEADER_SIZE)
+    {
+        PyErr_SetString(PyExc_ValueError, "Truncated TEX header");
+        goto done;
+    }
+
+    width = lgp_get_u32(header + TEX_WIDTH);
+    height = lgp_get_u32(header + TEX_HEIGHT);
+    bytes_per_pixel = lgp_get_u32(header + TEX_BYTES_PER_PIXEL);
+    color_key = lgp_get_u32(header + TEX_COLOR_KEY);
+    palette_size = lgp_get_u32(header + TEX_PALETTE_FLAG) ? lgp_get_u32(header + TEX_PALETTE_SIZE) : 0;
+    colors = lgp_get_u32(header + TEX_COLORS_PER_PALETTE);
+    count = (unsigned long long)width * height;
+    pixels = header + TEX_HEADER_SIZE + palette_size * 4ULL;
+
+    if (!count || count > PY_SSIZE_T_MAX / 4 || bytes_per_pixel < 1 || bytes_per_pixel > 4 ||
+        (palette_size && bytes_per_pixel != 1) ||
+        TEX_HEADER_SIZE + palette_size * 4ULL + count * bytes_per_pixel > (unsigned long long)data.len)
+    {
+        PyErr_SetString(PyExc_ValueError, "Invalid or truncated TEX data");
+        goto done;
+    }
+
+    if (!colors || colors > palette_size) colors = palette_size;
+
+    if (palette_size && (palette < 0 || (unsigned long long)(palette + 1) * colors > palette_size))
+    {
+        PyErr_Format(PyExc_IndexError, "Palette %i out of range", palette);
+        goto done;
+    }
+
+    image = PyByteArray_FromStringAndSize(NULL, count * 4);
+    if (!image)
+        goto done;
+
+    out = (unsigned char *)PyByteArray_AS_STRING(image);
+
+    /* up to 2 bytes per pixel, every possible value goes through a table */
+    if (bytes_per_pixel <= 2)
+        lut = calloc(1 << (8 * bytes_per_pixel), sizeof(*lut));
+
+    if (bytes_per_pixel <= 2 && !lut)
+    {
+        Py_CLEAR(image);
+        PyErr_NoMemory();
+        goto done;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    if (palette_size)
+    {
+        /* the palettes are stored as BGRA */
+        const unsigned char *colors_start = header + TEX_HEADER_SIZE + (unsigned long long)palette * colors * 4;
+        unsigned int i;
+
+        for (i = 0; i < colors && i < 256; i++)
+        {
+            const unsigned char *bgra = colors_start + i * 4;
+            unsigned char rgba[4] = {bgra[2], bgra[1], bgra[0], 255};
+
+            if (color_key && !bgra[0] && !bgra[1] && !bgra[2]) rgba[3] = 0;
+
+            memcpy(&lut[i], rgba, 4);
+        }
+    }
+    else if (lut)
+    {
+        unsigned int value;
+
+        for (value = 0; value < 1U << (8 * bytes_per_pixel); value++)
+        {
+            unsigned char rgba[4];
+
+            tex_color(header, value, color_key, rgba);
+            memcpy(&lut[value], rgba, 4);
+        }
+    }
+
+    if (bytes_per_pixel == 1)
+    {
+        unsigned long long i;
+
+        for (i = 0; i < count; i++)
+            memcpy(out + i * 4, &lut[pixels[i]], 4);
+    }
+    else if (bytes_per_pixel == 2)
+    {
+        unsigned long long i;
+
+        for (i = 0; i < count; i++)
+            memcpy(out + i * 4, &lut[pixels[i * 2] | pixels[i * 2 + 1] << 8], 4);
+    }
+    else
+    {
+        unsigned long long i;
+
+        for (i = 0; i < count; i++)
+        {
+            const unsigned char *p = pixels + i * bytes_per_pixel;
+            unsigned int value = p[0] | p[1] << 8 | p[2] << 16;
+
+            if (bytes_per_pixel == 4) value |= (unsigned int)p[3] << 24;
+
+            tex_color(header, value, color_key, out + i * 4);
+        }
+    }
+    Py_END_ALLOW_THREADS
+
+done:
+    free(lut);
+    PyBuffer_Release(&data);
+
+    if (!image)
+        return NULL;
+
+    return Py_BuildValue("(IIN)", width, height, image);
+}
+
+PyDoc_STRVAR(decode_tex_doc, "decode_tex(data, palette=0) -> (width, height, pixels)\n\n\
+Decode an FF7 TEX texture into a bytearray of RGBA pixels, row by row.\n\
+Paletted textures use the given palette; with the color key flag set, black\n\
+is made transparent. The GIL is released while decoding.");
 
 static PyObject *
 lgp_new(PyTypeObject *type, PyObject *args, PyObject *keywords)
 {
     _LGPObject *obj;
-    const char *file;
+    PyObject *file;
 
     if (keywords != NULL && !_PyArg_NoKeywords(Py_TYPE(type)->tp_name, keywords))
         return NULL;
 
-    if (!PyArg_ParseTuple(args, "s:_lgp._LGP", &file))
+    if (!PyArg_ParseTuple(args, "O:_lgp._LGP", &file))
         return NULL;
 
     obj = (_LGPObject *)type->tp_alloc(type, 0);
     if (obj == NULL)
         return NULL;
 
-    obj->file = file;
+    obj->fd = -1;
+
+    /* a file descriptor, anything exposing a buffer, or a path */
+    if (PyLong_Check(file))
+    {
+        obj->fd = PyLong_AsLong(file);
+        if (obj->fd < 0)
+        {
+            if (!PyErr_Occurred())
+                PyErr_SetString(PyExc_ValueError, "Invalid file descriptor");
+            Py_DECREF(obj);
+            return NULL;
+        }
+    }
+    else if (PyObject_CheckBuffer(file))
+    {
+        if (PyObject_GetBuffer(file, &obj->view, PyBUF_SIMPLE) < 0)
+        {
+            Py_DECREF(obj);
+            return NULL;
+        }
+    }
+    else if (!PyUnicode_FSConverter(file, &obj->path))
+    {
+        Py_DECREF(obj);
+        return NULL;
+    }
+
     return (PyObject *)obj;
 }
 
 static void
 lgp_dealloc(_LGPObject *self)
 {
-    Py_XDECREF(self->file);
+    Py_XDECREF(self->path);
+    if (self->view.obj)
+        PyBuffer_Release(&self->view);
     ((PyObject *)self)->ob_type->tp_free((PyObject *)self);
 }
 
+static PyObject *
+lgp_get_file(_LGPObject *self, void *closure)
+{
+    if (self->path)
+        return PyUnicode_DecodeFSDefaultAndSize(PyBytes_AS_STRING(self->path), PyBytes_GET_SIZE(self->path));
+    if (self->fd >= 0)
+        return PyLong_FromLong(self->fd);
+    if (self->view.obj)
+    {
+        Py_INCREF(self->view.obj);
+        return self->view.obj;
+    }
+    Py_RETURN_NONE;
+}
+
 static PyMethodDef lgp_methods[] = {
-    /* {"pack",        lgp_pack,    METH_VARARGS,   pack_doc}, */
-    {"unpack", (PyCFunction)lgp_unpack, METH_NOARGS, unpack_doc},
+    {"unpack", (PyCFunction)lgp_unpack, METH_VARARGS | METH_KEYWORDS, unpack_doc},
     {NULL,          NULL},
 };
 
-static PyMemberDef lgp_members[] = {
-    {"file", T_STRING, offsetof(_LGPObject, file), READONLY},
+static PyGetSetDef lgp_getset[] = {
+    {"file", (getter)lgp_get_file, NULL, "The file name, descriptor or buffer the archive was opened from."},
     {NULL},
 };
 
@@ -749,8 +2587,8 @@ static PyTypeObject _LGPType = {
     0,                                          /* tp_iter */
     0,                                          /* tp_iternext */
     lgp_methods,                                /* tp_methods */
-    lgp_members,                                /* tp_members */
-    0,                                          /* tp_getset */
+    0,                                          /* tp_members */
+    lgp_getset,                                 /* tp_getset */
     0,                                          /* tp_base */
     0,                                          /* tp_dict */
     0,                                          /* tp_descr_get */
@@ -771,6 +2609,13 @@ static PyTypeObject _LGPType = {
     0,                                          /* tp_finalize */
 };
 
+static PyMethodDef lgp_functions[] = {
+    {"pack", (PyCFunction)lgp_pack, METH_VARARGS | METH_KEYWORDS, pack_doc},
+    {"find", (PyCFunction)lgp_find, METH_VARARGS, find_doc},
+    {"decode_tex", (PyCFunction)lgp_decode_tex, METH_VARARGS | METH_KEYWORDS, decode_tex_doc},
+    {NULL,          NULL},
+};
+
 PyDoc_STRVAR(lgp_doc, "Test lgp module.");
 
 static struct PyModuleDef lgpmodule = {
@@ -778,7 +2623,7 @@ static struct PyModuleDef lgpmodule = {
     "_lgp",
     lgp_doc,
     0, /* multiple "initialization" just copies the module dict. */
-    NULL,
+    lgp_functions,
     NULL,
     NULL,
     NULL,
@@ -797,6 +2642,10 @@ PyInit__lgp(void)
     if (PyType_Ready(&_LGPType) < 0)
         return NULL;
 
+    pack_lock = PyThread_allocate_lock();
+    if (!pack_lock)
+        return PyErr_NoMemory();
+
     Py_INCREF(&_LGPType);
     PyModule_AddObject(dict, "_LGP", (PyObject *)&_LGPType);
 
@@ -0,0 +1,42 @@
+import os
+import sys
+
+import pytest
+
+sys.path.insert(0, os.path.dirname(os.path.dirname(os.path.abspath(__file__))))
+
+import lgp
+
+# names must fit FF7's lookup table: at most 15 characters, starting with a
+# letter or digit; the two same.txt are stored in the conflicts table
+FILES = {
+    "aali.tex": b"texture data",
+    "empty.p": b"",
+    "big.bin": bytes(range(256)) * 4096,
+    "a/same.txt": b"first",
+    "b/same.txt": b"second one",
+}
+
+@pytest.fixture
+def tree(tmp_path):
+    root = tmp_path / "tree"
+    for path, data in FILES.items():
+        (root / path).parent.mkdir(parents=True, exist_ok=True)
+        (root / path).write_bytes(data)
+    return str(root)
+
+@pytest.fixture
+def archive(tree, tmp_path):
+    path = str(tmp_path / "test.lgp")
+    lgp.pack(tree, path)
+    return path
+
+def read_tree(root):
+    """All files under 'root', as {relative path: contents}."""
+    files = {}
+    for dirpath, dirnames, filenames in os.walk(root):
+        for name in filenames:
+            path = os.path.join(dirpath, name)
+            with open(path, "rb") as f:
+                files[os.path.relpath(path, root).replace(os.sep, "/")] = f.read()
+    return files
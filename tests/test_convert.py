@@ -0,0 +1,55 @@
+import io
+import tarfile
+import zipfile
+
+import pytest
+
+import lgp
+from conftest import FILES
+
+def _read(path):
+    with open(path, "rb") as f:
+        return f.read()
+
+@pytest.mark.parametrize("compression", ["", "gz", "bz2", "xz"])
+def test_tar(archive, tmp_path, compression):
+    tar = str(tmp_path / "test.tar")
+    lgp.to_tar(archive, tar, compression)
+    with tarfile.open(tar) as t:
+        assert {info.name: t.extractfile(info).read() for info in t} == FILES
+    # packing the same members again gives the same archive
+    output = str(tmp_path / "back.lgp")
+    lgp.from_tar(tar, output)
+    assert _read(output) == _read(archive)
+
+def test_tar_stream(archive):
+    stream = io.BytesIO()
+    lgp.to_tar(archive, stream, "gz")
+    stream.seek(0)
+    with tarfile.open(fileobj=stream, mode="r|gz") as t:
+        assert {info.name: t.extractfile(info).read() for info in t} == FILES
+
+def test_tar_order(tmp_path):
+    # a compressed tar in another order than the archive's is read in one pass
+    tar = str(tmp_path / "reversed.tar.gz")
+    with tarfile.open(tar, "w:gz") as t:
+        for path, data in reversed(list(FILES.items())):
+            info = tarfile.TarInfo(path)
+            info.size = len(data)
+            t.addfile(info, io.BytesIO(data))
+    output = str(tmp_path / "test.lgp")
+    lgp.from_tar(tar, output)
+    assert lgp.verify(output) == []
+    lgp.extract(output, str(tmp_path / "out"))
+    for path, data in FILES.items():
+        assert _read(str(tmp_path / "out" / path)) == data
+
+@pytest.mark.parametrize("compression", [zipfile.ZIP_STORED, zipfile.ZIP_DEFLATED])
+def test_zip(archive, tmp_path, compression):
+    path = str(tmp_path / "test.zip")
+    lgp.to_zip(archive, path, compression)
+    with zipfile.ZipFile(path) as z:
+        assert {name: z.read(name) for name in z.namelist()} == FILES
+    output = str(tmp_path / "back.lgp")
+    lgp.from_zip(path, output)
+    assert _read(output) == _read(archive)
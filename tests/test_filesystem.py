@@ -0,0 +1,76 @@
+import stat
+
+import pytest
+
+import lgp
+from conftest import FILES
+
+def test_getattr(archive):
+    fs = lgp.LGPFileSystem(archive)
+    try:
+        assert stat.S_ISDIR(fs.getattr("/")["st_mode"])
+        assert stat.S_ISDIR(fs.getattr("/a")["st_mode"])
+        attrs = fs.getattr("/big.bin")
+        assert stat.S_ISREG(attrs["st_mode"])
+        assert attrs["st_size"] == len(FILES["big.bin"])
+        assert fs.getattr("/b/same.txt")["st_size"] == len(FILES["b/same.txt"])
+        with pytest.raises(FileNotFoundError):
+            fs.getattr("/missing")
+    finally:
+        fs.close()
+
+def test_readdir(archive):
+    fs = lgp.LGPFileSystem(archive)
+    try:
+        assert fs.readdir("/") == [".", "..", "a", "aali.tex", "b", "big.bin", "empty.p"]
+        assert fs.readdir("/a") == [".", "..", "same.txt"]
+        with pytest.raises(FileNotFoundError):
+            fs.readdir("/big.bin")
+    finally:
+        fs.close()
+
+def test_read(archive):
+    fs = lgp.LGPFileSystem(archive)
+    try:
+        assert fs.read("/a/same.txt", 100, 0) == b"first"
+        assert fs.read("/big.bin", 10, 1000) == FILES["big.bin"][1000:1010]
+        assert fs.read("/big.bin", 10, len(FILES["big.bin"])) == b""
+        assert fs.read("/empty.p", 10, 0) == b""
+        with pytest.raises(FileNotFoundError):
+            fs.read("/a", 10, 0)
+    finally:
+        fs.close()
+
+def test_overlay(archive, tmp_path):
+    # the archive given last wins, like with LGPSet
+    (tmp_path / "mod").mkdir()
+    (tmp_path / "mod" / "aali.tex").write_bytes(b"modded")
+    mod = str(tmp_path / "mod.lgp")
+    lgp.pack(str(tmp_path / "mod"), mod)
+    fs = lgp.LGPFileSystem(archive, mod)
+    try:
+        assert fs.read("/aali.tex", 100, 0) == b"modded"
+        assert fs.read("/empty.p", 100, 0) == b""
+    finally:
+        fs.close()
+
+def test_mount_backend(archive):
+    calls = []
+    def backend(filesystem, mountpoint):
+        calls.append(mountpoint)
+        assert filesystem.readdir("/b") == [".", "..", "same.txt"]
+        assert filesystem.read("/b/same.txt", 6, 0) == b"second"
+        calls.append(filesystem)
+    lgp.mount("/mnt/test", archive, backend=backend)
+    assert calls[0] == "/mnt/test"
+    # the archives are closed once the backend returns
+    assert not len(calls[1].archives)
+
+def test_mount_backend_error(archive):
+    filesystems = []
+    def backend(filesystem, mountpoint):
+        filesystems.append(filesystem)
+        raise RuntimeError("unmounted")
+    with pytest.raises(RuntimeError):
+        lgp.mount("/mnt/test", archive, backend=backend)
+    assert not len(filesystems[0].archives)
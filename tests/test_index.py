@@ -0,0 +1,96 @@
+import os
+import random
+
+import pytest
+
+import lgp
+from conftest import FILES
+
+def _archive(tmp_path, count):
+    # an archive of 'count' members, each holding its own name
+    entries = []
+    for i in range(count):
+        source = tmp_path / ("source%i" % i)
+        source.write_bytes(b"data %i" % i)
+        entries.append(("f%03i.bin" % i, str(source)))
+    path = str(tmp_path / "test.lgp")
+    lgp.pack(entries, path)
+    return path
+
+@pytest.mark.parametrize("count", range(1, 65))
+def test_sizes(tmp_path, count):
+    archive = _archive(tmp_path, count)
+    with lgp.SharedIndex(archive) as index:
+        for i in range(count):
+            member = index.find("f%03i.bin" % i)
+            assert member.path == "f%03i.bin" % i
+            data = index.read("F%03i.BIN" % i)
+            assert bytes(data) == b"data %i" % i
+            data.release()
+
+def test_perfect_hash():
+    # every set of keys gets placed, one key per slot
+    rng = random.Random(1)
+    for size in range(1, 65):
+        for trial in range(5):
+            keys = [bytes(rng.randrange(256) for i in range(8)) for j in range(size)]
+            keys = list(dict.fromkeys(keys))
+            seed, displacements, slots = lgp._perfect_hash(keys)
+            assert sorted(slots) == list(range(len(keys)))
+            for key, slot in zip(keys, slots):
+                hashes = lgp._name_hash(key, seed)
+                displacement = displacements[hashes[0] % len(displacements)]
+                assert lgp._perfect_slot(hashes, displacement, len(keys)) == slot
+
+def test_find(archive):
+    with lgp.SharedIndex(archive) as index:
+        member = index.find("A/SAME.TXT")
+        assert (member.path, member.name, member.size) == ("a/same.txt", "same.txt", 5)
+        data = index.read("b/Same.txt")
+        assert bytes(data) == FILES["b/same.txt"]
+        data.release()
+        data = index.read("EMPTY.P")
+        assert bytes(data) == b""
+        data.release()
+
+@pytest.mark.parametrize("path", ["missing", "same.txt", "c/same.txt", "big.bin/x", ""])
+def test_missing(archive, path):
+    with lgp.SharedIndex(archive) as index:
+        with pytest.raises(KeyError):
+            index.find(path)
+        with pytest.raises(KeyError):
+            index.read(path)
+
+def test_index_file(archive, tmp_path):
+    index = str(tmp_path / "shared.idx")
+    assert lgp.build_index(archive, index) == index
+    with lgp.SharedIndex(archive, index) as shared:
+        assert shared.find("big.bin").size == len(FILES["big.bin"])
+    assert not os.path.exists(archive + ".idx")
+
+def test_stale(tree, archive):
+    with lgp.SharedIndex(archive) as index:
+        assert index.find("aali.tex").size == len(FILES["aali.tex"])
+    # the archive changes size: the index is built again
+    with open(os.path.join(tree, "aali.tex"), "wb") as f:
+        f.write(b"a larger texture")
+    lgp.pack(tree, archive)
+    with lgp.SharedIndex(archive) as index:
+        data = index.read("aali.tex")
+        assert bytes(data) == b"a larger texture"
+        data.release()
+    # and so it is when only the modification time differs
+    st = os.stat(archive)
+    os.utime(archive, ns=(st.st_atime_ns, st.st_mtime_ns + 10**9))
+    with open(archive + ".idx", "rb") as f:
+        before = f.read()
+    with lgp.SharedIndex(archive) as index:
+        assert index.find("aali.tex").size == len(b"a larger texture")
+    with open(archive + ".idx", "rb") as f:
+        assert f.read() != before
+
+def test_invalid_index(archive):
+    with open(archive + ".idx", "wb") as f:
+        f.write(b"garbage")
+    with lgp.SharedIndex(archive) as index:
+        assert index.find("a/same.txt").size == 5
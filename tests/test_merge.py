@@ -0,0 +1,67 @@
+import os
+
+import pytest
+
+import lgp
+from conftest import FILES, read_tree
+
+def _pack(path, files):
+    # pack {archive path: data} into 'path', the sources going next to it
+    sources = str(path) + ".src"
+    manifest = []
+    for i, (name, data) in enumerate(files.items()):
+        os.makedirs(sources, exist_ok=True)
+        source = os.path.join(sources, str(i))
+        with open(source, "wb") as f:
+            f.write(data)
+        manifest.append((name, source))
+    lgp.pack(manifest, str(path))
+    return str(path)
+
+def _contents(archive):
+    folder = archive + ".out"
+    lgp.extract(archive, folder)
+    return read_tree(folder)
+
+@pytest.fixture
+def mod(tmp_path):
+    return _pack(tmp_path / "mod.lgp", {"aali.tex": b"modded texture", "added.p": b"added"})
+
+def test_last_wins(archive, mod, tmp_path):
+    output = str(tmp_path / "merged.lgp")
+    lgp.merge(output, archive, mod)
+    assert _contents(output) == dict(FILES, **{"aali.tex": b"modded texture", "added.p": b"added"})
+    assert lgp.verify(output) == []
+    output = str(tmp_path / "reversed.lgp")
+    lgp.merge(output, mod, archive)
+    assert _contents(output) == dict(FILES, **{"added.p": b"added"})
+
+def test_keep_both(archive, mod, tmp_path):
+    # the later one goes in a folder named after its archive
+    output = tmp_path / "merged.lgp"
+    lgp.merge(output, archive, mod, policy="keep-both")
+    expected = dict(FILES, **{"mod/aali.tex": b"modded texture", "added.p": b"added"})
+    assert _contents(str(output)) == expected
+    assert lgp.verify(str(output)) == []
+
+def test_keep_both_duplicate(tmp_path):
+    # 'a/same.txt' is taken already, the second 'same.txt' can't go there
+    first = _pack(tmp_path / "first.lgp", {"same.txt": b"1", "a/same.txt": b"2"})
+    second = _pack(tmp_path / "a.lgp", {"same.txt": b"3"})
+    output = str(tmp_path / "merged.lgp")
+    with pytest.raises(ValueError):
+        lgp.merge(output, first, second, policy="keep-both")
+    assert not [name for name in os.listdir(str(tmp_path)) if name.startswith("merged")]
+
+def test_unknown_policy(archive, tmp_path):
+    with pytest.raises(ValueError):
+        lgp.merge(str(tmp_path / "merged.lgp"), archive, policy="first-wins")
+
+def test_in_place(archive, mod, tmp_path):
+    # the output can be one of the inputs
+    expected = str(tmp_path / "expected.lgp")
+    lgp.merge(expected, archive, mod)
+    lgp.merge(archive, archive, mod)
+    with open(archive, "rb") as f, open(expected, "rb") as g:
+        assert f.read() == g.read()
+    assert not [name for name in os.listdir(str(tmp_path)) if name.endswith(".tmp")]
@@ -0,0 +1,260 @@
+import importlib
+import io
+import mmap
+import os
+import pathlib
+import threading
+
+import pytest
+
+import lgp
+from conftest import FILES, read_tree
+
+def _read(path):
+    with open(path, "rb") as f:
+        return f.read()
+
+def test_roundtrip(archive, tmp_path):
+    assert lgp.verify(archive) == []
+    lgp.extract(archive, str(tmp_path / "out"))
+    assert read_tree(str(tmp_path / "out")) == FILES
+
+def test_deterministic(tree, archive, tmp_path):
+    lgp.pack(tree, str(tmp_path / "again.lgp"))
+    assert _read(str(tmp_path / "again.lgp")) == _read(archive)
+
+def test_manifest(tree, archive, tmp_path):
+    entries = [(path, os.path.join(tree, path)) for path in reversed(list(FILES))]
+    lgp.pack(entries, str(tmp_path / "manifest.lgp"))
+    assert _read(str(tmp_path / "manifest.lgp")) == _read(archive)
+
+def test_base(tree, archive, tmp_path):
+    # unchanged members come from the base, which may be the output itself
+    cache = str(tmp_path / "cache.json")
+    lgp.pack(tree, archive, cache=cache)
+    with open(os.path.join(tree, "aali.tex"), "wb") as f:
+        f.write(b"changed")
+    lgp.pack(tree, archive, cache=cache, base=archive)
+    lgp.pack(tree, str(tmp_path / "fresh.lgp"))
+    assert _read(archive) == _read(str(tmp_path / "fresh.lgp"))
+    assert not os.path.exists(archive + ".tmp")
+
+def test_base_without_cache(tree, archive, tmp_path):
+    # sources older than the base aren't read, newer or resized ones are
+    st = os.stat(archive)
+    older = st.st_mtime_ns - 10**9
+    for path in FILES:
+        os.utime(os.path.join(tree, path), ns=(older, older))
+    with open(os.path.join(tree, "a", "same.txt"), "wb") as f:
+        f.write(b"FIRST")
+    os.utime(os.path.join(tree, "a", "same.txt"), ns=(older, older))
+    with open(os.path.join(tree, "b", "same.txt"), "wb") as f:
+        f.write(b"SECOND ONE")
+    with open(os.path.join(tree, "aali.tex"), "wb") as f:
+        f.write(b"resized texture")
+    os.utime(os.path.join(tree, "aali.tex"), ns=(older, older))
+    output = str(tmp_path / "repacked.lgp")
+    lgp.pack(tree, output, base=archive)
+    lgp.extract(output, str(tmp_path / "out"))
+    expected = dict(FILES, **{"b/same.txt": b"SECOND ONE", "aali.tex": b"resized texture"})
+    assert read_tree(str(tmp_path / "out")) == expected
+
+def _shuffle_toc(archive):
+    # reorder the ToC entries and the conflicts pointing at them, leaving the
+    # lookup table as it was, so it points at the wrong entries
+    with open(archive, "r+b") as f:
+        data = bytearray(f.read())
+        num = int.from_bytes(data[12:16], "little")
+        order = list(range(num))[::-1]
+        position = {old: new for new, old in enumerate(order)}
+        data[16:16+num*27] = b"".join(data[16+old*27:16+old*27+27] for old in order)
+        pointer = 16 + num * 27 + 900 * 4 + 2
+        for i in range(int.from_bytes(data[pointer-2:pointer], "little")):
+            count = int.from_bytes(data[pointer:pointer+2], "little")
+            pointer += 2
+            for j in range(count):
+                index = int.from_bytes(data[pointer+128:pointer+130], "little")
+                data[pointer+128:pointer+130] = position[index].to_bytes(2, "little")
+                pointer += 130
+        f.seek(0)
+        f.write(data)
+
+def test_rebuild_index(archive, tmp_path):
+    _shuffle_toc(archive)
+    assert lgp.verify(archive) != []
+    assert lgp.rebuild_index(archive)
+    assert lgp.verify(archive) == []
+    assert not lgp.rebuild_index(archive)
+    folder = str(tmp_path / "out")
+    lgp.extract(archive, folder)
+    assert read_tree(folder) == FILES
+
+@pytest.mark.parametrize("name", ["z!x.tex", "a", "0123456789abcdef"])
+def test_invalid_names(name, tmp_path):
+    source = tmp_path / "source"
+    source.write_bytes(b"data")
+    with pytest.raises(ValueError):
+        lgp.pack([(name, str(source))], str(tmp_path / "bad.lgp"))
+    assert not os.path.exists(str(tmp_path / "bad.lgp"))
+
+def test_native_pack(tree, archive, tmp_path):
+    _lgp = pytest.importorskip("_lgp")
+    output = str(tmp_path / "native.lgp")
+    _lgp.pack(tree, output)
+    assert _read(output) == _read(archive)
+    _lgp.pack(tree, output, workers=4)
+    assert _read(output) == _read(archive)
+
+def test_native_pack_stream(tree, archive):
+    # anything with a write() method takes the archive, written in order
+    _lgp = pytest.importorskip("_lgp")
+    stream = io.BytesIO()
+    _lgp.pack(tree, stream, workers=4)
+    assert stream.getvalue() == _read(archive)
+
+def test_native_pack_pipe(tree, archive):
+    # a pipe fills up long before the archive is written, the reader has to
+    # keep draining it while the GIL is released
+    _lgp = pytest.importorskip("_lgp")
+    read_fd, write_fd = os.pipe()
+    chunks = []
+    def drain():
+        with os.fdopen(read_fd, "rb") as f:
+            for chunk in iter(lambda: f.read(65536), b""):
+                chunks.append(chunk)
+    reader = threading.Thread(target=drain)
+    reader.start()
+    try:
+        _lgp.pack(tree, write_fd, workers=4)
+    finally:
+        os.close(write_fd)
+        reader.join()
+    assert b"".join(chunks) == _read(archive)
+
+def test_native_unpack(archive, tmp_path):
+    _lgp = pytest.importorskip("_lgp")
+    folder = str(tmp_path / "out")
+    _lgp._LGP(archive).unpack(folder)
+    assert read_tree(folder) == FILES
+    # only members that changed are written again
+    os.remove(os.path.join(folder, "a", "same.txt"))
+    with open(os.path.join(folder, "big.bin"), "wb") as f:
+        f.write(b"truncated")
+    _lgp._LGP(archive).unpack(folder, incremental=True)
+    assert read_tree(folder) == FILES
+
+def test_native_filters(archive, tmp_path):
+    # the C filters select the same members as extract()
+    _lgp = pytest.importorskip("_lgp")
+    cases = [("*.TXT", None), ("[ab]*", "a/*"), (["b*", "e*"], "[!b]*"), (None, "*[.]t?x")]
+    for i, (include, exclude) in enumerate(cases):
+        native = str(tmp_path / ("native%i" % i))
+        python = str(tmp_path / ("python%i" % i))
+        _lgp._LGP(archive).unpack(native, include=include, exclude=exclude)
+        lgp.extract(archive, python, include=include, exclude=exclude)
+        assert read_tree(native) == read_tree(python)
+
+@pytest.mark.parametrize("kind", ["path", "pathlike", "fd", "bytes", "mmap", "memoryview"])
+def test_native_inputs(archive, tmp_path, kind):
+    # an archive can be opened from a name, a descriptor or any buffer
+    _lgp = pytest.importorskip("_lgp")
+    folder = str(tmp_path / "out")
+    with open(archive, "rb") as f:
+        if kind == "path":
+            source = archive
+        elif kind == "pathlike":
+            source = pathlib.Path(archive)
+        elif kind == "fd":
+            source = f.fileno()
+        elif kind == "bytes":
+            source = f.read()
+        else:
+            data = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+            source = data if kind == "mmap" else memoryview(data)
+        lgp_file = _lgp._LGP(source)
+        if kind == "pathlike":
+            assert lgp_file.file == archive
+        else:
+            assert lgp_file.file == source
+        lgp_file.unpack(folder)
+        assert read_tree(folder) == FILES
+        if kind in ("path", "pathlike"):
+            # the folder defaults to the archive's name
+            lgp_file.unpack()
+            assert read_tree(archive + "_output") == FILES
+        else:
+            with pytest.raises(TypeError):
+                lgp_file.unpack()
+        del lgp_file
+        if kind in ("mmap", "memoryview"):
+            if kind == "memoryview":
+                source.release()
+            data.close()
+
+def test_main(archive, tmp_path, monkeypatch):
+    # the command line is only acted upon by main(), never on import
+    folder = str(tmp_path / "out")
+    monkeypatch.setattr("sys.argv", ["lgp.py", "--extract", archive, folder])
+    importlib.reload(lgp)
+    assert not os.path.exists(folder)
+    lgp.main(["lgp.py", "--extract", archive, folder])
+    assert read_tree(folder) == FILES
+
+def _split_parts(archive):
+    parts = {}
+    with open(archive + ".parts", encoding="utf-8") as f:
+        for line in f:
+            part, path = line.rstrip("\n").split("\t")
+            parts.setdefault(part, []).append(path)
+    return parts
+
+def test_native_split(tmp_path):
+    # one conflict group more than an archive can hold
+    _lgp = pytest.importorskip("_lgp")
+    files = {}
+    for i in range(4097):
+        files["a/f%04d.p" % i] = b"a%i" % i
+        files["b/f%04d.p" % i] = b"b%i" % i
+    source = tmp_path / "source"
+    for path, data in files.items():
+        (source / path).parent.mkdir(parents=True, exist_ok=True)
+        (source / path).write_bytes(data)
+    output = str(tmp_path / "split.lgp")
+    with pytest.raises(OverflowError):
+        _lgp.pack(str(source), output)
+    _lgp.pack(str(source), output, split=True)
+    parts = _split_parts(output)
+    assert sorted(parts) == [output, str(tmp_path / "split_1.lgp")]
+    assert sorted(p for paths in parts.values() for p in paths) == sorted(files)
+    # the two files with a name stay in the same archive
+    for paths in parts.values():
+        assert {p[2:] for p in paths if p.startswith("a/")} == {p[2:] for p in paths if p.startswith("b/")}
+    folder = str(tmp_path / "out")
+    for part in parts:
+        assert lgp.verify(part) == []
+        lgp.extract(part, folder)
+    assert read_tree(folder) == files
+
+def test_native_split_conflict_entries(tmp_path):
+    # a name can only be used 255 times in an archive
+    _lgp = pytest.importorskip("_lgp")
+    source = tmp_path / "source"
+    for i in range(256):
+        (source / ("d%i" % i)).mkdir(parents=True)
+        (source / ("d%i" % i) / "same.txt").write_bytes(b"%i" % i)
+    output = str(tmp_path / "split.lgp")
+    with pytest.raises(OverflowError):
+        _lgp.pack(str(source), output)
+    _lgp.pack(str(source), output, split=True)
+    assert sorted(len(paths) for paths in _split_parts(output).values()) == [1, 255]
+
+def test_native_limits(tree, tmp_path):
+    _lgp = pytest.importorskip("_lgp")
+    with pytest.raises(ValueError):
+        _lgp.pack(tree, io.BytesIO(), split=True)
+    source = tmp_path / "source"
+    source.mkdir()
+    with open(str(source / "huge.bin"), "wb") as f:
+        f.truncate(1 << 32)
+    with pytest.raises(OverflowError):
+        _lgp.pack(str(source), str(tmp_path / "huge.lgp"), split=True)
@@ -0,0 +1,87 @@
+import os
+
+import pytest
+
+import lgp
+from conftest import FILES
+
+def _read(path):
+    with open(path, "rb") as f:
+        return f.read()
+
+@pytest.fixture
+def new(tree, archive, tmp_path):
+    # change one member, remove one and add another
+    with open(os.path.join(tree, "aali.tex"), "wb") as f:
+        f.write(b"new texture data")
+    os.remove(os.path.join(tree, "empty.p"))
+    with open(os.path.join(tree, "added.bin"), "wb") as f:
+        f.write(b"added" * 1000)
+    path = str(tmp_path / "new.lgp")
+    lgp.pack(tree, path)
+    return path
+
+def test_apply(archive, new, tmp_path):
+    patch = str(tmp_path / "test.patch")
+    lgp.make_patch(archive, new, patch)
+    # unchanged members aren't stored in the patch
+    assert os.path.getsize(patch) < os.path.getsize(new)
+    output = str(tmp_path / "patched.lgp")
+    lgp.apply(archive, patch, output)
+    assert _read(output) == _read(new)
+
+def test_apply_in_place(archive, new, tmp_path):
+    patch = str(tmp_path / "test.patch")
+    lgp.make_patch(archive, new, patch)
+    lgp.apply(archive, patch, archive)
+    assert _read(archive) == _read(new)
+    assert not [name for name in os.listdir(str(tmp_path)) if name.endswith(".tmp")]
+
+def test_apply_replaces(archive, new, tmp_path):
+    patch = str(tmp_path / "test.patch")
+    lgp.make_patch(archive, new, patch)
+    lgp.apply(archive, patch)
+    assert _read(archive) == _read(new)
+
+def test_wrong_archive(archive, new, tmp_path):
+    patch = str(tmp_path / "test.patch")
+    lgp.make_patch(archive, new, patch)
+    with pytest.raises(ValueError):
+        lgp.apply(new, patch, str(tmp_path / "patched.lgp"))
+    with pytest.raises(ValueError):
+        lgp.apply(archive, new, str(tmp_path / "patched.lgp"))
+
+def test_same_layout(tree, archive, new, tmp_path):
+    # an archive laid out the same way, but where a member the patch copies
+    # has other contents
+    patch = str(tmp_path / "test.patch")
+    lgp.make_patch(archive, new, patch)
+    with open(os.path.join(tree, "aali.tex"), "wb") as f:
+        f.write(FILES["aali.tex"])
+    with open(os.path.join(tree, "empty.p"), "wb") as f:
+        pass
+    os.remove(os.path.join(tree, "added.bin"))
+    with open(os.path.join(tree, "big.bin"), "wb") as f:
+        f.write(FILES["big.bin"][::-1])
+    other = str(tmp_path / "other.lgp")
+    lgp.pack(tree, other)
+    assert os.path.getsize(other) == os.path.getsize(archive)
+    output = str(tmp_path / "patched.lgp")
+    with pytest.raises(ValueError):
+        lgp.apply(other, patch, output)
+    assert not os.path.exists(output)
+    assert not os.path.exists(output + ".tmp")
+
+def test_replaced_members(tree, archive, new, tmp_path):
+    # members the patch replaces don't need to match
+    patch = str(tmp_path / "test.patch")
+    lgp.make_patch(archive, new, patch)
+    with open(os.path.join(tree, "aali.tex"), "wb") as f:
+        f.write(FILES["aali.tex"].upper())
+    with open(os.path.join(tree, "empty.p"), "wb") as f:
+        pass
+    os.remove(os.path.join(tree, "added.bin"))
+    other = str(tmp_path / "other.lgp")
+    lgp.pack(tree, other)
+    lgp.apply(other, patch)
+    assert _read(other) == _read(new)
@@ -0,0 +1,57 @@
+import random
+
+import pytest
+
+import lgp
+from conftest import FILES
+
+@pytest.fixture(params=["native", "python"])
+def implementation(request, monkeypatch):
+    # search with the _lgp extension, and with the pure Python fallback
+    if request.param == "native":
+        pytest.importorskip("_lgp")
+    else:
+        monkeypatch.setattr(lgp, "_lgp", None)
+    return request.param
+
+def _occurrences(files, patterns):
+    hits = []
+    for path, data in files.items():
+        for pattern in patterns:
+            hits += [(path, i, pattern) for i in range(len(data)) if data.startswith(pattern, i)]
+    return sorted(hits)
+
+def test_find(implementation):
+    assert lgp._find(b"aaaa", [b"aa"]) == [(0, 0), (1, 0), (2, 0)]
+    assert lgp._find(b"xabcab", [b"ab", b"b", b"abc"]) == [(1, 0), (1, 2), (2, 1), (4, 0), (5, 1)]
+    assert lgp._find(b"abc", [b"abcd", b"x"]) == []
+    assert lgp._find(memoryview(b"__ab__")[2:], [b"ab"]) == [(0, 0)]
+
+def test_find_matches_fallback():
+    _lgp = pytest.importorskip("_lgp")
+    rng = random.Random(0)
+    data = bytes(rng.choice(b"ab") for i in range(5000))
+    patterns = [b"a", b"abba", b"bbb", b"ab" * 5]
+    hits = sorted((i, n) for n, p in enumerate(patterns) for i in range(len(data)) if data.startswith(p, i))
+    assert _lgp.find(data, patterns) == hits
+
+def test_search(archive, implementation):
+    patterns = [b"e", b"\x00\x01\x02", "on"]
+    expected = _occurrences(FILES, [b"e", b"\x00\x01\x02", b"on"])
+    assert sorted(lgp.search(archive, *patterns, workers=4)) == expected
+
+def test_search_overlapping(archive, implementation):
+    # every position of a repeated pattern is reported
+    hits = lgp.search(archive, bytes(range(256)) * 2)
+    assert sorted(hits) == [("big.bin", i * 256, bytes(range(256)) * 2) for i in range(4095)]
+
+def test_search_filters(archive, implementation):
+    hits = lgp.search(archive, "e", include="*.txt")
+    assert sorted(hits) == _occurrences({"b/same.txt": FILES["b/same.txt"]}, [b"e"])
+    hits = lgp.search(archive, "e", include="*.txt", exclude="b/*")
+    assert hits == []
+
+@pytest.mark.parametrize("patterns", [(), ("",), ("x", b"")])
+def test_empty_pattern(archive, patterns):
+    with pytest.raises(ValueError):
+        lgp.search(archive, *patterns)
@@ -0,0 +1,142 @@
+import asyncio
+import os
+
+import pytest
+
+import lgp
+from conftest import FILES
+
+async def _request(reader, writer, method, path, **headers):
+    # send one request and read the whole response; headers are lowercased
+    lines = ["%s %s HTTP/1.1" % (method, path), "Host: localhost"]
+    lines += ["%s: %s" % (key.replace("_", "-"), value) for key, value in headers.items()]
+    writer.write(("\r\n".join(lines) + "\r\n\r\n").encode("latin-1"))
+    await writer.drain()
+    head = (await reader.readuntil(b"\r\n\r\n")).decode("latin-1").split("\r\n")
+    status = int(head[0].split(" ")[1])
+    response = {}
+    for line in head[1:]:
+        if line:
+            key, value = line.split(":", 1)
+            response[key.strip().lower()] = value.strip()
+    body = b""
+    if method != "HEAD" and status != 304:
+        body = await reader.readexactly(int(response["content-length"]))
+    return status, response, body
+
+def _serve(archive, client):
+    # run client(reader, writer, url prefix) against a server on a free port
+    async def run():
+        server = await lgp.start_server(archive, port=0)
+        async with server:
+            port = server.sockets[0].getsockname()[1]
+            reader, writer = await asyncio.open_connection("127.0.0.1", port)
+            try:
+                return await client(reader, writer, "/" + os.path.basename(archive))
+            finally:
+                writer.close()
+    return asyncio.run(run())
+
+def test_get(archive):
+    async def client(reader, writer, prefix):
+        status, headers, body = await _request(reader, writer, "GET", prefix + "/big.bin")
+        assert status == 200
+        assert body == FILES["big.bin"]
+        assert headers["accept-ranges"] == "bytes"
+        assert headers["etag"]
+        status, headers, body = await _request(reader, writer, "GET", prefix + "/b/same.txt")
+        assert (status, body) == (200, FILES["b/same.txt"])
+        status, headers, body = await _request(reader, writer, "GET", prefix + "/empty.p")
+        assert (status, headers["content-length"], body) == (200, "0", b"")
+        status, headers, body = await _request(reader, writer, "HEAD", prefix + "/big.bin")
+        assert (status, headers["content-length"]) == (200, str(len(FILES["big.bin"])))
+    _serve(archive, client)
+
+def test_errors(archive):
+    async def client(reader, writer, prefix):
+        status, headers, body = await _request(reader, writer, "GET", prefix + "/missing")
+        assert status == 404
+        status, headers, body = await _request(reader, writer, "GET", "/other.lgp/big.bin")
+        assert status == 404
+        status, headers, body = await _request(reader, writer, "POST", prefix + "/big.bin")
+        assert (status, headers["allow"]) == (405, "GET, HEAD")
+    _serve(archive, client)
+
+def test_range(archive):
+    data = FILES["big.bin"]
+    async def client(reader, writer, prefix):
+        url = prefix + "/big.bin"
+        status, headers, body = await _request(reader, writer, "GET", url, Range="bytes=10-19")
+        assert (status, body) == (206, data[10:20])
+        assert headers["content-range"] == "bytes 10-19/%i" % len(data)
+        status, headers, body = await _request(reader, writer, "GET", url, Range="bytes=1000-")
+        assert (status, body) == (206, data[1000:])
+        status, headers, body = await _request(reader, writer, "GET", url, Range="bytes=-5")
+        assert (status, body) == (206, data[-5:])
+        # the end is clamped to the size of the member
+        status, headers, body = await _request(reader, writer, "GET", url, Range="bytes=5-%i" % (len(data) * 2))
+        assert (status, body) == (206, data[5:])
+    _serve(archive, client)
+
+def test_range_not_satisfiable(archive):
+    size = len(FILES["big.bin"])
+    async def client(reader, writer, prefix):
+        for value in ("bytes=%i-" % size, "bytes=-0"):
+            status, headers, body = await _request(reader, writer, "GET", prefix + "/big.bin", Range=value)
+            assert (status, body) == (416, b"")
+            assert headers["content-range"] == "bytes */%i" % size
+        status, headers, body = await _request(reader, writer, "GET", prefix + "/empty.p", Range="bytes=0-")
+        assert status == 416
+    _serve(archive, client)
+
+def test_range_ignored(archive):
+    # ranges that aren't understood get the whole member
+    async def client(reader, writer, prefix):
+        for value in ("lines=1-2", "bytes=0-1,5-6", "bytes=20-10", "bytes=-", "bytes=x-1"):
+            status, headers, body = await _request(reader, writer, "GET", prefix + "/big.bin", Range=value)
+            assert (status, body) == (200, FILES["big.bin"])
+            assert "content-range" not in headers
+    _serve(archive, client)
+
+def test_if_range(archive):
+    data = FILES["big.bin"]
+    async def client(reader, writer, prefix):
+        url = prefix + "/big.bin"
+        etag = (await _request(reader, writer, "HEAD", url))[1]["etag"]
+        status, headers, body = await _request(reader, writer, "GET", url, Range="bytes=0-9", If_Range=etag)
+        assert (status, body) == (206, data[:10])
+        # a stale validator gets the whole member
+        status, headers, body = await _request(reader, writer, "GET", url, Range="bytes=0-9", If_Range='"0-0"')
+        assert (status, body) == (200, data)
+    _serve(archive, client)
+
+def test_not_modified(archive):
+    async def client(reader, writer, prefix):
+        url = prefix + "/aali.tex"
+        etag = (await _request(reader, writer, "HEAD", url))[1]["etag"]
+        status, headers, body = await _request(reader, writer, "GET", url, If_None_Match=etag)
+        assert (status, body) == (304, b"")
+        assert headers["etag"] == etag
+        assert "content-length" not in headers
+        status, headers, body = await _request(reader, writer, "GET", url, If_None_Match='"0-0"')
+        assert (status, body) == (200, FILES["aali.tex"])
+    _serve(archive, client)
+
+def test_keep_alive(archive):
+    async def client(reader, writer, prefix):
+        for i in range(5):
+            status, headers, body = await _request(reader, writer, "GET", prefix + "/a/same.txt")
+            assert (status, body) == (200, FILES["a/same.txt"])
+            assert headers["connection"] == "keep-alive"
+        status, headers, body = await _request(reader, writer, "GET", prefix + "/a/same.txt", Connection="close")
+        assert headers["connection"] == "close"
+        assert await reader.read() == b""
+    _serve(archive, client)
+
+def test_http_1_0_closes(archive):
+    async def client(reader, writer, prefix):
+        writer.write(("GET %s/aali.tex HTTP/1.0\r\n\r\n" % prefix).encode("latin-1"))
+        response = await reader.read()
+        assert response.startswith(b"HTTP/1.1 200 OK\r\n")
+        assert response.endswith(b"\r\n\r\n" + FILES["aali.tex"])
+    _serve(archive, client)
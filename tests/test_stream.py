@@ -0,0 +1,70 @@
+import io
+import struct
+
+import pytest
+
+import lgp
+from conftest import FILES, read_tree
+
+class _Stream:
+    # a stream that can't seek, handing out short reads
+    def __init__(self, data):
+        self._data = io.BytesIO(data)
+
+    def read(self, size=-1):
+        return self._data.read(min(size, 1000) if size >= 0 else size)
+
+def _archive(toc, blocks):
+    # toc is a list of (name, offset in the data), blocks is the data itself,
+    # laid out in that order after the header; the lookup table isn't needed
+    start = 16 + 27 * len(toc) + 900 * 4 + 2
+    header = b"\0\0SQUARESOFT" + struct.pack("<I", len(toc))
+    for name, offset in toc:
+        header += struct.pack("<20sIBH", name.encode(), start + offset, 14, 0)
+    return header + bytes(900 * 4 + 2) + blocks + b"FINAL FANTASY7"
+
+def _block(name, data):
+    return struct.pack("<20sI", name.encode(), len(data)) + data
+
+def test_iter_stream(archive):
+    with open(archive, "rb") as f:
+        assert dict(lgp.iter_stream(_Stream(f.read()))) == FILES
+
+def test_extract_stream(archive, tmp_path):
+    folder = str(tmp_path / "out")
+    with open(archive, "rb") as f:
+        lgp.extract_stream(_Stream(f.read()), folder, spill=0)
+    assert read_tree(folder) == FILES
+
+def test_out_of_order(tmp_path):
+    # the data is laid out backwards from the ToC
+    blocks = [_block("c.p", b"third" * 1000), _block("b.p", b"second"), _block("a.p", b"first")]
+    offsets = [0, len(blocks[0]), len(blocks[0]) + len(blocks[1])]
+    data = _archive([("a.p", offsets[2]), ("b.p", offsets[1]), ("c.p", offsets[0])], b"".join(blocks))
+    expected = {"a.p": b"first", "b.p": b"second", "c.p": b"third" * 1000}
+    assert list(lgp.iter_stream(_Stream(data))) == sorted(expected.items(), reverse=True)
+    folder = str(tmp_path / "out")
+    lgp.extract_stream(_Stream(data), folder, spill=0)
+    assert read_tree(folder) == expected
+
+def test_shared(tmp_path):
+    # b.p is stored inside the data of a.p, and c.p shares a.p's block
+    inner = _block("b.p", b"inner")
+    outer = _block("a.p", b"x" * 100 + inner + b"y" * 4000)
+    data = _archive([("a.p", 0), ("b.p", 24 + 100), ("c.p", 0)], outer)
+    expected = {"a.p": outer[24:], "b.p": b"inner", "c.p": outer[24:]}
+    assert dict(lgp.iter_stream(_Stream(data))) == expected
+    folder = str(tmp_path / "out")
+    lgp.extract_stream(_Stream(data), folder)
+    assert read_tree(folder) == expected
+    # both start over 4000 bytes before the end of a.p
+    with pytest.raises(ValueError):
+        dict(lgp.iter_stream(_Stream(data), spill=1024))
+    with pytest.raises(ValueError):
+        lgp.extract_stream(_Stream(data), str(tmp_path / "short"), spill=1024)
+
+def test_truncated(archive):
+    with open(archive, "rb") as f:
+        data = f.read()
+    with pytest.raises(EOFError):
+        dict(lgp.iter_stream(_Stream(data[:len(data) // 2])))
@@ -0,0 +1,92 @@
+import struct
+
+import pytest
+
+import lgp
+
+_lgp = pytest.importorskip("_lgp")
+
+def _tex(width, height, pixels, palette=(), colors=0, bpp=1, masks=(0, 0, 0, 0), shifts=(0, 0, 0, 0),
+         alpha_bits=0, color_key=0):
+    # a TEX file; palette is a list of RGBA colors, stored as BGRA
+    header = bytearray(0xEC)
+    fields = {0x00: 1, 0x08: color_key, 0x3C: width, 0x40: height, 0x68: bpp, 0x78: alpha_bits}
+    if palette:
+        fields.update({0x4C: 1, 0x58: len(palette), 0x34: colors or len(palette)})
+    for i in range(4):
+        fields.update({0x7C + i * 4: masks[i], 0x8C + i * 4: shifts[i]})
+    for offset, value in fields.items():
+        struct.pack_into("<I", header, offset, value)
+    return bytes(header) + b"".join(bytes((b, g, r, a)) for r, g, b, a in palette) + bytes(pixels)
+
+def _decode(data, palette=0):
+    width, height, pixels = _lgp.decode_tex(data, palette)
+    return width, height, [tuple(pixels[i:i+4]) for i in range(0, len(pixels), 4)]
+
+RED, GREEN, BLUE, BLACK = (255, 0, 0, 255), (0, 255, 0, 255), (0, 0, 255, 255), (0, 0, 0, 255)
+CLEAR = (0, 0, 0, 0)
+
+RGB565 = {"bpp": 2, "masks": (0xF800, 0x07E0, 0x001F, 0), "shifts": (11, 5, 0, 0)}
+ARGB1555 = {"bpp": 2, "masks": (0x7C00, 0x03E0, 0x001F, 0x8000), "shifts": (10, 5, 0, 15), "alpha_bits": 1}
+ARGB8888 = {"bpp": 4, "masks": (0xFF0000, 0xFF00, 0xFF, 0xFF000000), "shifts": (16, 8, 0, 24), "alpha_bits": 8}
+
+def test_paletted():
+    data = _tex(2, 2, [0, 1, 2, 0], palette=[RED, GREEN, (0, 0, 0, 128)])
+    assert _decode(data) == (2, 2, [RED, GREEN, BLACK, RED])
+
+def test_paletted_color_key():
+    # black is transparent
+    data = _tex(3, 1, [0, 1, 2], palette=[RED, BLACK, BLUE], color_key=1)
+    assert _decode(data) == (3, 1, [RED, CLEAR, BLUE])
+
+def test_palettes():
+    # two palettes of two colors each
+    data = _tex(2, 1, [0, 1], palette=[RED, GREEN, BLUE, BLACK], colors=2)
+    assert _decode(data, 0)[2] == [RED, GREEN]
+    assert _decode(data, 1)[2] == [BLUE, BLACK]
+    for palette in (-1, 2):
+        with pytest.raises(IndexError):
+            _lgp.decode_tex(data, palette)
+
+def test_rgb565():
+    pixels = struct.pack("<4H", 0xF800, 0x07E0, 0x001F, 0)
+    assert _decode(_tex(2, 2, pixels, **RGB565)) == (2, 2, [RED, GREEN, BLUE, BLACK])
+    assert _decode(_tex(2, 2, pixels, color_key=1, **RGB565))[2] == [RED, GREEN, BLUE, CLEAR]
+
+def test_argb1555():
+    pixels = struct.pack("<3H", 0xFC00, 0x7C00, 0x8000 | 0x03E0)
+    assert _decode(_tex(3, 1, pixels, **ARGB1555))[2] == [RED, (255, 0, 0, 0), GREEN]
+
+def test_argb8888():
+    pixels = struct.pack("<2I", 0x80112233, 0xFF000000)
+    assert _decode(_tex(1, 2, pixels, **ARGB8888)) == (1, 2, [(0x11, 0x22, 0x33, 0x80), BLACK])
+
+@pytest.mark.parametrize("data", [
+    b"",
+    _tex(2, 2, [0, 1, 2, 0], palette=[RED, GREEN, BLUE])[:0xEB],
+    _tex(2, 2, [0, 1, 2], palette=[RED, GREEN, BLUE]),
+    _tex(2, 2, bytes(7), **RGB565),
+    _tex(0, 2, b""),
+    _tex(1, 1, bytes(2), palette=[RED], bpp=2),
+    _tex(1, 1, bytes(5), bpp=5),
+])
+def test_invalid(data):
+    with pytest.raises(ValueError):
+        _lgp.decode_tex(data)
+
+def test_decode_textures(tmp_path, monkeypatch):
+    source = tmp_path / "source"
+    source.mkdir()
+    (source / "red.tex").write_bytes(_tex(2, 1, [0, 0], palette=[RED]))
+    (source / "rgb.tex").write_bytes(_tex(1, 2, struct.pack("<2H", 0x001F, 0x07E0), **RGB565))
+    (source / "other.bin").write_bytes(b"not a texture")
+    archive = str(tmp_path / "textures.lgp")
+    lgp.pack(str(source), archive)
+    textures = lgp.decode_textures(archive, workers=2)
+    assert sorted(textures) == ["red.tex", "rgb.tex"]
+    assert textures["red.tex"].shape == (1, 2, 4)
+    assert textures["red.tex"].tolist() == [[list(RED), list(RED)]]
+    assert textures["rgb.tex"].tolist() == [[list(BLUE)], [list(GREEN)]]
+    monkeypatch.setattr(lgp, "_lgp", None)
+    with pytest.raises(ImportError):
+        lgp.decode_textures(archive)